@@ -21,8 +21,11 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -63,8 +66,10 @@ enum	page {
 	PAGE_DODELETEPLAYER,
 	PAGE_DODISABLEPLAYER,
 	PAGE_DOENABLEPLAYER,
+	PAGE_DOEXPORT,
 	PAGE_DOGETEXPR,
 	PAGE_DOGETHIGHEST,
+	PAGE_DOGETMETRICS,
 	PAGE_DOGETHISTORY,
 	PAGE_DOLOADGAMES,
 	PAGE_DOLOADPLAYERS,
@@ -138,6 +143,7 @@ enum	key {
 	KEY_SESSID,
 	KEY_SHOWHISTORY,
 	KEY_SHUFFLE,
+	KEY_TABLE,
 	KEY_URI,
 	KEY_USER,
 	KEY_WINNERS,
@@ -155,6 +161,26 @@ struct	hghstor {
 	struct expr	*expr;
 };
 
+/*
+ * Buffered output for streaming table exports.
+ * Rows are accumulated and written to the client in chunks.
+ */
+struct	exportstor {
+	struct kreq	*r;
+	size_t		 bufsz; /* bytes in buffer */
+	char		 buf[16384];
+};
+
+/*
+ * Names of the exportable tables (see enum export).
+ */
+static	const char *const exportnames[EXPORT__MAX] = {
+	"choices", /* EXPORT_CHOICES */
+	"lotteries", /* EXPORT_LOTTERIES */
+	"payoffs", /* EXPORT_PAYOFFS */
+	"roundups", /* EXPORT_ROUNDUPS */
+};
+
 #define	PERM_LOGIN	0x01
 #define	PERM_HTML	0x08
 #define	PERM_JSON	0x10
@@ -176,8 +202,10 @@ static	unsigned int perms[PAGE__MAX] = {
 	PERM_JSON | PERM_LOGIN, /* PAGE_DODELETEPLAYER */
 	PERM_JSON | PERM_LOGIN, /* PAGE_DODISABLEPLAYER */
 	PERM_JSON | PERM_LOGIN, /* PAGE_DOENABLEPLAYER */
+	PERM_CSV | PERM_JSON | PERM_LOGIN, /* PAGE_DOEXPORT */
 	PERM_JSON | PERM_LOGIN, /* PAGE_DOGETEXPR */
 	PERM_CSV | PERM_LOGIN, /* PAGE_DOGETHIGHEST */
+	PERM_JSON | PERM_LOGIN, /* PAGE_DOGETMETRICS */
 	PERM_JSON | PERM_LOGIN, /* PAGE_DOGETHISTORY */
 	PERM_JSON | PERM_LOGIN, /* PAGE_DOLOADGAMES */
 	PERM_JSON | PERM_LOGIN, /* PAGE_DOLOADPLAYERS */
@@ -212,8 +240,10 @@ static const char *const pages[PAGE__MAX] = {
 	"dodeleteplayer", /* PAGE_DODELETEPLAYER */
 	"dodisableplayer", /* PAGE_DODISABLEPLAYER */
 	"doenableplayer", /* PAGE_DOENABLEPLAYER */
+	"doexport", /* PAGE_DOEXPORT */
 	"dogetexpr", /* PAGE_DOGETEXPR */
 	"dogethighest", /* PAGE_DOGETHIGHEST */
+	"dogetmetrics", /* PAGE_DOGETMETRICS */
 	"dogethistory", /* PAGE_DOGETHISTORY */
 	"doloadgames", /* PAGE_DOLOADGAMES */
 	"doloadplayers", /* PAGE_DOLOADPLAYERS */
@@ -293,6 +323,7 @@ static const struct kvalid keys[KEY__MAX] = {
 	{ kvalid_int, "sessid" }, /* KEY_SESSID */
 	{ kvalid_int, "showhistory" }, /* KEY_SHOWHISTORY */
 	{ kvalid_int, "shuffle" }, /* KEY_SHUFFLE */
+	{ kvalid_stringne, "table" }, /* KEY_TABLE */
 	{ kvalid_stringne, "uri" }, /* KEY_URI */
 	{ kvalid_stringne, "user" }, /* KEY_USER */
 	{ kvalid_uint, "winners" }, /* KEY_WINNERS */
@@ -300,55 +331,215 @@ static const struct kvalid keys[KEY__MAX] = {
 };
 
 /*
- * This function simply wakes up every thirty seconds and checks the
- * current round.
- * If the round has advanced, it tries to mail players.
- * (See mail_roundadvance() for details.)
+ * Queue outbound mail and make sure that there's a sender running to
+ * deliver it (see mail_sendq()).
+ * See db_mailq_add() for "round" and "target".
+ * If "r" is not NULL, this closes out the HTTP connection, so the
+ * response must already have been written.
+ */
+static void
+queuemail(struct kreq *r, enum mailq kind, const char *uri, 
+	const char *loginuri, int64_t round, int64_t target)
+{
+
+	db_mailq_add(kind, uri, loginuri, round, target);
+	if (0 == doublefork(r)) {
+		mail_sendq();
+		exit(EXIT_SUCCESS);
+	}
+}
+
+/*
+ * Longest mailround() sleeps without re-checking the round, in case
+ * we've somehow missed a wake-up.
+ */
+#define	MAILROUND_MAXWAIT 300
+
+/*
+ * Seconds between incremental backups taken by mailround(), or zero to
+ * not take any.
+ */
+#ifndef BACKUP_INCR
+#define	BACKUP_INCR 0
+#endif
+
+/*
+ * A series of incremental backups in DATADIR/archive.
+ * The series starts with a compressed snapshot, <tag>-base.db.gz, then
+ * each <tag>-<seq>.sql.gz holds the choice, payoff, and lottery rows
+ * added since the last.
+ * To restore, decompress the snapshot and pipe each delta in order
+ * through sqlite3(1) into it.
+ */
+struct	incrbackup {
+	int64_t		 marks[BACKUP__MAX]; /* last rows archived */
+	long long	 tag; /* series name (start time) */
+	size_t		 seq; /* next delta number */
+	time_t		 next; /* when next delta is due */
+	int		 ok; /* have snapshot: series running */
+};
+
+/*
+ * Start a series of incremental backups with a snapshot.
+ * The marks are taken before the snapshot, so the first delta may
+ * repeat some of its rows; this is harmless.
+ */
+static void
+incrbackup_start(struct incrbackup *ib)
+{
+	char	 fname[PATH_MAX];
+
+	memset(ib, 0, sizeof(struct incrbackup));
+	if (BACKUP_INCR <= 0)
+		return;
+
+	if (-1 == mkdir(DATADIR "/archive", 0700) && EEXIST != errno) {
+		WARN(DATADIR "/archive");
+		return;
+	}
+
+	ib->tag = time(NULL);
+	db_backup_marks(ib->marks);
+	(void)snprintf(fname, sizeof(fname), 
+		DATADIR "/archive/%lld-base.db.gz", ib->tag);
+	if ( ! db_backup(fname))
+		return;
+
+	ib->ok = 1;
+	ib->next = time(NULL) + BACKUP_INCR;
+}
+
+/*
+ * Archive rows added since the last delta, if it's time to ("force"
+ * makes it so).
+ */
+static void
+incrbackup_step(struct incrbackup *ib, time_t now, int force)
+{
+	char	 fname[PATH_MAX];
+	size_t	 rows;
+
+	if ( ! ib->ok || ( ! force && now < ib->next))
+		return;
+
+	(void)snprintf(fname, sizeof(fname), 
+		DATADIR "/archive/%lld-%06zu.sql.gz", 
+		ib->tag, ib->seq);
+	if ( ! db_backup_incr(fname, ib->marks, &rows))
+		WARNX("Incremental backup failed: %s", fname);
+	else if (rows > 0) {
+		INFO("Incremental backup: %s (%zu rows)", fname, rows);
+		ib->seq++;
+	}
+	ib->next = now + BACKUP_INCR;
+}
+
+/*
+ * Interrupts ppoll(2) in mailround().
+ */
+static void
+mailround_wake(int sig)
+{
+
+	/* Do nothing. */
+}
+
+/*
+ * This function sleeps until the current round is due to end by time
+ * (advancing it itself, if no request has done so), or until woken by
+ * ROUND_WAKESIG from whoever advanced the round.
+ * If the round has advanced, it queues mail to players.
  * It exits if the round-daemon identifier has changed, the game has
  * ended, or any other number of conditions.
  */
 static void
 mailround(const char *uri)
 {
-	struct expr	*expr;
+	struct exprround er;
+	struct incrbackup ib;
+	struct sigaction sa;
+	struct timespec	 ts;
+	sigset_t	 mask, omask;
 	pid_t		 pid;
 	int64_t		 round;
+	time_t		 now, deadline;
 
 	round = -1;
 	pid = getpid();
+
+	/* Only let ROUND_WAKESIG through while we're sleeping. */
+	memset(&sa, 0, sizeof(struct sigaction));
+	sa.sa_handler = mailround_wake;
+	sigemptyset(&sa.sa_mask);
+	if (-1 == sigaction(ROUND_WAKESIG, &sa, NULL))
+		WARN("sigaction");
+	sigemptyset(&mask);
+	sigaddset(&mask, ROUND_WAKESIG);
+	if (-1 == sigprocmask(SIG_BLOCK, &mask, &omask))
+		WARN("sigprocmask");
+
 	db_expr_setmailer(0, pid);
-	expr = NULL;
 
 	INFO("Round mailer starting: %u", pid);
 
+	incrbackup_start(&ib);
+
 	for (;;) {
-		db_expr_free(expr);
-		sleep(30);
-		expr = db_expr_get(0);
+		db_expr_getround(&er);
+		now = time(NULL);
 
-		if (pid != expr->roundpid) {
+		if (pid != er.roundpid) {
 			WARNX("Round mailer error: "
 				"invoked with different pid: "
 				"my %u != %" PRId64 " (exiting)", 
-				pid, expr->roundpid);
+				pid, er.roundpid);
 			break;
-		} else if (expr->state > ESTATE_STARTED ||
-		           expr->round >= expr->rounds) {
+		} else if (er.state > ESTATE_STARTED ||
+		           er.round >= er.rounds) {
 			INFO("Round mailer exiting: "
 				"experiment over: %u", pid);
+			incrbackup_step(&ib, now, 1);
 			break;
-		} else if (expr->round == round)
-			continue;
+		} 
+
+		incrbackup_step(&ib, now, 0);
+		
+		if (er.round != round) {
+			INFO("Round mailer is firing for round %" 
+				PRId64 " (last saw %" PRId64 "), "
+				"%lld seconds after advance: %u", 
+				er.round, round, (long long)
+				(now - er.roundbegan), pid);
+			queuemail(NULL, MAILQ_ROUND, 
+				uri, NULL, round, er.round);
+			round = er.round;
+			INFO("Round mailer has fired: %u", pid);
+		}
 
-		INFO("Round mailer is firing for round %" 
-			PRId64 " (last saw %" PRId64 "): %u", 
-			expr->round, round, pid);
-		mail_roundadvance(uri, round, expr->round);
-		round = expr->round;
-		INFO("Round mailer has fired: %u", pid);
+		/* 
+		 * When does the round end by time? 
+		 * If it's already passed and we can't advance, wait a
+		 * little so that we don't spin.
+		 */
+		deadline = er.round < 0 ? er.start : 
+			er.roundbegan + er.minutes * 60;
+		if (deadline <= now) {
+			if (db_expr_advance())
+				continue;
+			deadline = now + 1;
+		}
+
+		if (ib.ok && ib.next < deadline)
+			deadline = ib.next > now ? ib.next : now + 1;
+
+		ts.tv_sec = deadline - now;
+		ts.tv_nsec = 0;
+		if (ts.tv_sec > MAILROUND_MAXWAIT)
+			ts.tv_sec = MAILROUND_MAXWAIT;
+		if (-1 == ppoll(NULL, 0, &ts, &omask) && EINTR != errno)
+			WARN("ppoll");
 	}
 
-	db_expr_free(expr);
 	db_expr_setmailer(pid, 0);
 	INFO("Round mailer exiting: %u", pid);
 }
@@ -513,9 +704,6 @@ static void
 senddomturkbonuses(struct kreq *r)
 {
 	struct expr	 *expr;
-	size_t		  i, psz;
-	struct player	**ps;
-	int64_t		 *scores;
 
 	http_open(r, KHTTP_200);
 	khttp_body(r);
@@ -530,29 +718,18 @@ senddomturkbonuses(struct kreq *r)
 		return;
 	}
 
-	ps = db_player_load_bonuses(&scores, &psz);
-
 	/*
 	 * We want to send our bonuses behind the scenes: with many
 	 * players, it may take some time as each one is separate.
 	 * Close out our current connection.
 	 */
 	if (0 == doublefork(r)) {
-		for (i = 0; i < psz; i++) {
-			mturk_bonus(expr, ps[i], scores[i]);
-			db_player_free(ps[i]);
-		}
-		free(ps);
-		free(scores);
+		mturk_bonuses(expr);
 		db_expr_free(expr);
 		exit(EXIT_SUCCESS);
 	}
 
 	db_expr_free(expr);
-	for (i = 0; i < psz; i++) 
-		db_player_free(ps[i]);
-	free(ps);
-	free(scores);
 }
 
 static void
@@ -569,6 +746,167 @@ senddogethighest(struct kreq *r)
 	db_expr_free(stor.expr);
 }
 
+static void
+export_flush(struct exportstor *stor)
+{
+
+	if (stor->bufsz > 0)
+		khttp_write(stor->r, stor->buf, stor->bufsz);
+	stor->bufsz = 0;
+}
+
+static void
+export_write(struct exportstor *stor, const char *cp, size_t sz)
+{
+
+	if (stor->bufsz + sz > sizeof(stor->buf))
+		export_flush(stor);
+	if (sz > sizeof(stor->buf)) {
+		khttp_write(stor->r, cp, sz);
+		return;
+	}
+	memcpy(stor->buf + stor->bufsz, cp, sz);
+	stor->bufsz += sz;
+}
+
+static void
+export_puts(struct exportstor *stor, const char *cp)
+{
+
+	export_write(stor, cp, strlen(cp));
+}
+
+static void
+export_putc(struct exportstor *stor, char c)
+{
+
+	if (stor->bufsz == sizeof(stor->buf))
+		export_flush(stor);
+	stor->buf[stor->bufsz++] = c;
+}
+
+/*
+ * Write a CSV field, quoting it if it contains any separators or
+ * quotes (which are doubled).
+ */
+static void
+export_csv(struct exportstor *stor, const char *cp)
+{
+
+	if (NULL == strpbrk(cp, ",\"\r\n")) {
+		export_puts(stor, cp);
+		return;
+	}
+	export_putc(stor, '"');
+	for ( ; '\0' != *cp; cp++) {
+		if ('"' == *cp)
+			export_putc(stor, '"');
+		export_putc(stor, *cp);
+	}
+	export_putc(stor, '"');
+}
+
+/*
+ * Write a JSON value: if "num" is set, it's written as a number (or null,
+ * if empty), otherwise as an escaped string.
+ */
+static void
+export_json(struct exportstor *stor, const char *cp, int num)
+{
+	char		 buf[8];
+
+	if (num) {
+		export_puts(stor, '\0' == *cp ? "null" : cp);
+		return;
+	}
+
+	export_putc(stor, '"');
+	for ( ; '\0' != *cp; cp++) {
+		if ('"' == *cp || '\\' == *cp) {
+			export_putc(stor, '\\');
+			export_putc(stor, *cp);
+		} else if ((unsigned char)*cp < 0x20) {
+			snprintf(buf, sizeof(buf), 
+				"\\u%.4x", (unsigned char)*cp);
+			export_puts(stor, buf);
+		} else
+			export_putc(stor, *cp);
+	}
+	export_putc(stor, '"');
+}
+
+/*
+ * Write a single exported row as either CSV (with a header) or as a
+ * line-delimited JSON object, depending upon the request type.
+ * In JSON, integer columns are always numbers and the rest (e.g.,
+ * rational numbers) always strings.
+ */
+static void
+sendexportrow(const char *const *cols, const char *const *vals, 
+	const char *types, size_t sz, void *arg)
+{
+	struct exportstor *stor = arg;
+	size_t		   i;
+
+	if (KMIME_APP_JSON == stor->r->mime) {
+		if (NULL == vals)
+			return;
+		export_putc(stor, '{');
+		for (i = 0; i < sz; i++) {
+			if (i > 0)
+				export_putc(stor, ',');
+			export_json(stor, cols[i], 0);
+			export_putc(stor, ':');
+			export_json(stor, vals[i], 'i' == types[i]);
+		}
+		export_puts(stor, "}\n");
+		return;
+	}
+
+	for (i = 0; i < sz; i++) {
+		if (i > 0)
+			export_putc(stor, ',');
+		export_csv(stor, NULL == vals ? cols[i] : vals[i]);
+	}
+	export_putc(stor, '\n');
+}
+
+/*
+ * Stream an entire data table as CSV or JSON lines.
+ * This uses constant memory regardless of the table size.
+ */
+static void
+senddoexport(struct kreq *r)
+{
+	struct exportstor	*stor;
+	size_t			 i;
+
+	i = EXPORT__MAX;
+	if ( ! kpairbad(r, KEY_TABLE))
+		for (i = 0; i < EXPORT__MAX; i++)
+			if (0 == strcmp(exportnames[i], 
+			    r->fieldmap[KEY_TABLE]->parsed.s))
+				break;
+
+	if (EXPORT__MAX == i) {
+		http_open(r, KHTTP_400);
+		khttp_body(r);
+		return;
+	}
+
+	http_open(r, KHTTP_200);
+	khttp_head(r, kresps[KRESP_CONTENT_DISPOSITION],
+		"attachment; filename=\"%s.%s\"", 
+		exportnames[i], ksuffixes[r->mime]);
+	khttp_body(r);
+
+	stor = kcalloc(1, sizeof(struct exportstor));
+	stor->r = r;
+	db_export(i, sendexportrow, stor);
+	export_flush(stor);
+	free(stor);
+}
+
 static void
 senddogetexpr(struct kreq *r)
 {
@@ -654,6 +992,116 @@ senddogetexpr(struct kreq *r)
 	db_expr_free(expr);
 }
 
+static	const char *const metricnames[METRIC__MAX] = {
+	"requests", /* METRIC_REQUESTS */
+	"loads", /* METRIC_LOADS */
+	"notmodified", /* METRIC_NOTMOD */
+	"plays", /* METRIC_PLAYS */
+	"joins", /* METRIC_JOINS */
+	"busy", /* METRIC_BUSY */
+};
+
+static	const char *const mhistnames[MHIST__MAX] = {
+	"request", /* MHIST_REQUEST */
+	"db", /* MHIST_DB */
+	"roundup", /* MHIST_ROUNDUP */
+};
+
+/*
+ * Upper bound (in milliseconds) of the bucket holding the "q" quantile
+ * of durations in "h", or zero if there are none.
+ */
+static double
+hist_quantile(const struct metrichist *h, double q)
+{
+	uint64_t	 seen, want;
+	size_t		 i;
+
+	if (0 == h->count)
+		return(0.0);
+	want = h->count * q;
+	for (seen = 0, i = 0; i < METRICS_BUCKETS - 1; i++)
+		if ((seen += h->buckets[i]) > want)
+			break;
+	if (i == METRICS_BUCKETS - 1)
+		return(h->max / 1.0e3);
+	return((1ULL << (i + 1)) / 1.0e3);
+}
+
+/*
+ * Report the shared metrics (see metrics.c): each counter's total and
+ * per-second rate over the last ten and sixty seconds, and latency
+ * histograms.
+ * This only maps a file and counts the mail queue, so it's cheap enough
+ * to poll every few seconds.
+ */
+static void
+senddogetmetrics(struct kreq *r)
+{
+	struct metrics	 m;
+	struct kjsonreq	 req;
+	uint64_t	 loads;
+	size_t		 i, j;
+
+	if ( ! metrics_read(&m)) {
+		http_open(r, KHTTP_409);
+		khttp_body(r);
+		return;
+	}
+
+	http_open(r, KHTTP_200);
+	khttp_body(r);
+	kjson_open(&req, r);
+	kjson_obj_open(&req);
+	kjson_putintp(&req, "since", m.since);
+	kjson_putintp(&req, "mailq", db_mailq_count());
+
+	kjson_objp_open(&req, "counters");
+	for (i = 0; i < METRIC__MAX; i++) {
+		kjson_objp_open(&req, metricnames[i]);
+		kjson_putintp(&req, "total", m.totals[i]);
+		kjson_putdoublep(&req, "rate10", 
+			metrics_window(&m, i, 10) / 10.0);
+		kjson_putdoublep(&req, "rate60", 
+			metrics_window(&m, i, 60) / 60.0);
+		kjson_obj_close(&req);
+	}
+	kjson_obj_close(&req);
+
+	/* Fraction of experiment loads we didn't need to send. */
+	loads = metrics_window(&m, METRIC_LOADS, 60);
+	if (loads > 0)
+		kjson_putdoublep(&req, "notmodratio", 
+			metrics_window(&m, METRIC_NOTMOD, 60) / 
+			(double)loads);
+	else
+		kjson_putnullp(&req, "notmodratio");
+
+	kjson_objp_open(&req, "histograms");
+	for (i = 0; i < MHIST__MAX; i++) {
+		kjson_objp_open(&req, mhistnames[i]);
+		kjson_putintp(&req, "count", m.hists[i].count);
+		kjson_putdoublep(&req, "summs", 
+			m.hists[i].sum / 1.0e3);
+		kjson_putdoublep(&req, "maxms", 
+			m.hists[i].max / 1.0e3);
+		kjson_putdoublep(&req, "p50ms", 
+			hist_quantile(&m.hists[i], 0.5));
+		kjson_putdoublep(&req, "p99ms", 
+			hist_quantile(&m.hists[i], 0.99));
+		/* Bucket j holds durations under 2^(j+1) us. */
+		kjson_arrayp_open(&req, "buckets");
+		for (j = 0; j < METRICS_BUCKETS; j++)
+			kjson_putint(&req, m.hists[i].buckets[j]);
+		kjson_array_close(&req);
+		kjson_obj_close(&req);
+	}
+	kjson_obj_close(&req);
+
+	kjson_obj_close(&req);
+	kjson_close(&req);
+}
+
 static void
 senddoenableplayer(struct kreq *r)
 {
@@ -751,10 +1199,7 @@ senddotestsmtp(struct kreq *r)
 
 	http_open(r, KHTTP_200);
 	khttp_body(r);
-	if (0 == doublefork(r)) {
-		mail_test();
-		exit(EXIT_SUCCESS);
-	}
+	queuemail(r, MAILQ_TEST, NULL, NULL, -1, -1);
 }
 
 static void
@@ -963,12 +1408,7 @@ senddobackup(struct kreq *r)
 
 	http_open(r, KHTTP_200);
 	khttp_body(r);
-	db_close();
-
-	if (0 == doublefork(r)) {
-		mail_backup();
-		exit(EXIT_SUCCESS);
-	}
+	queuemail(r, MAILQ_BACKUP, NULL, NULL, -1, -1);
 }
 
 static void
@@ -1139,7 +1579,6 @@ senddosetinstr(struct kreq *r)
 static void
 senddoresetpasswordss(struct kreq *r)
 {
-	pid_t		 pid;
 	char		*loginuri, *uri;
 	struct expr	*expr;
 
@@ -1163,28 +1602,9 @@ senddoresetpasswordss(struct kreq *r)
 		"/playerlogin.html", 
 		kschemes[r->scheme], r->host);
 	db_expr_free(expr);
-	db_close();
-
-	if (-1 == (pid = fork())) {
-		WARN("fork");
-		return;
-	} else if (pid > 0) {
-		if (-1 == waitpid(pid, NULL, 0))
-			WARN("waitpid");
-		free(loginuri);
-		free(uri);
-		return;
-	}
-
-	khttp_child_free(r);
-	if (daemon(1, 1) < 0) 
-		WARN("daemon");
-	else
-		mail_players(uri, loginuri);
-
+	queuemail(r, MAILQ_PLAYERS, uri, loginuri, -1, -1);
 	free(loginuri);
 	free(uri);
-	exit(EXIT_SUCCESS);
 }
 
 static void
@@ -1208,14 +1628,7 @@ senddoresendmail(struct kreq *r)
 		"/playerlogin.html", 
 		kschemes[r->scheme], r->host);
 	db_expr_free(expr);
-
-	if (0 == doublefork(r)) {
-		mail_players(uri, loginuri);
-		free(loginuri);
-		free(uri);
-		exit(EXIT_SUCCESS);
-	}
-
+	queuemail(r, MAILQ_PLAYERS, uri, loginuri, -1, -1);
 	free(loginuri);
 	free(uri);
 }
@@ -1725,27 +2138,9 @@ senddostartexpr(struct kreq *r)
 	 * added to the experiment.
 	 */
 
-	db_close();
-	if (-1 == (pid = fork())) {
-		WARN("fork");
-		return;
-	} else if (pid > 0) {
-		if (-1 == waitpid(pid, NULL, 0))
-			WARN("waitpid");
-		free(loginuri);
-		free(uri);
-		return;
-	}
-
-	khttp_child_free(r);
-	if (daemon(1, 1) < 0) 
-		WARN("daemon");
-	else
-		mail_players(uri, loginuri);
-
+	queuemail(r, MAILQ_PLAYERS, uri, loginuri, -1, -1);
 	free(loginuri);
 	free(uri);
-	exit(EXIT_SUCCESS);
 }
 
 static void
@@ -1923,6 +2318,8 @@ main(void)
 			pages, PAGE__MAX, PAGE_INDEX))
 		return(EXIT_FAILURE);
 
+	dbg_request(r.pagename);
+
 	switch (r.method) {
 	case (KMETHOD_GET):
 	case (KMETHOD_POST):
@@ -2025,12 +2422,18 @@ main(void)
 	case (PAGE_DOENABLEPLAYER):
 		senddoenableplayer(&r);
 		break;
+	case (PAGE_DOEXPORT):
+		senddoexport(&r);
+		break;
 	case (PAGE_DOGETHIGHEST):
 		senddogethighest(&r);
 		break;
 	case (PAGE_DOGETEXPR):
 		senddogetexpr(&r);
 		break;
+	case (PAGE_DOGETMETRICS):
+		senddogetmetrics(&r);
+		break;
 	case (PAGE_DOGETHISTORY):
 		senddogethistory(&r);
 		break;
@@ -2085,6 +2488,7 @@ main(void)
 	}
 
 out:
+	dbg_request_done();
 	khttp_free(&r);
 	return(EXIT_SUCCESS);
 }
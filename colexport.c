@@ -0,0 +1,485 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2015 Kristaps Dzonsons <kristaps@kcons.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <gmp.h>
+#include <sqlite3.h>
+
+/*
+ * A single output column.
+ * Each is written to its own file as an array of native-endian 64-bit
+ * integers or doubles.
+ */
+struct	col {
+	char		*name; /* column name */
+	int		 dbl; /* double (else int64_t) */
+	FILE		*f; /* output file */
+	size_t		 rows; /* rows written */
+};
+
+/*
+ * A table being written: a directory of column files.
+ */
+struct	table {
+	const char	*name; /* directory name */
+	char		*dir; /* full directory path */
+	struct col	*cols; /* columns */
+	size_t		 colsz; /* number of columns */
+	size_t		 inexact; /* rationals too big for 64 bits */
+};
+
+static int
+col_add(struct table *t, int dbl, const char *fmt, ...)
+{
+	va_list	 ap;
+	void	*p;
+	char	*path;
+	struct col *c;
+
+	p = reallocarray(t->cols, t->colsz + 1, sizeof(struct col));
+	if (NULL == p) {
+		perror(NULL);
+		return(0);
+	}
+	t->cols = p;
+	c = &t->cols[t->colsz];
+	memset(c, 0, sizeof(struct col));
+
+	va_start(ap, fmt);
+	if (-1 == vasprintf(&c->name, fmt, ap)) {
+		perror(NULL);
+		va_end(ap);
+		return(0);
+	}
+	va_end(ap);
+	t->colsz++;
+
+	c->dbl = dbl;
+	if (-1 == asprintf(&path, "%s/%s.%s",
+	    t->dir, c->name, dbl ? "f64" : "i64")) {
+		perror(NULL);
+		return(0);
+	} else if (NULL == (c->f = fopen(path, "w"))) {
+		perror(path);
+		free(path);
+		return(0);
+	}
+	free(path);
+	return(1);
+}
+
+static int
+col_int(struct col *c, int64_t v)
+{
+
+	c->rows++;
+	if (1 == fwrite(&v, sizeof(int64_t), 1, c->f))
+		return(1);
+	perror(c->name);
+	return(0);
+}
+
+static int
+col_double(struct col *c, double v)
+{
+
+	c->rows++;
+	if (1 == fwrite(&v, sizeof(double), 1, c->f))
+		return(1);
+	perror(c->name);
+	return(0);
+}
+
+/*
+ * Write the rational "q" into three consecutive columns starting at
+ * "c": the double value, then the exact numerator and denominator.
+ * If the numerator or denominator doesn't fit into 64 bits, both are
+ * written as zero (so the zero denominator flags it).
+ */
+static int
+col_mpq(struct table *t, struct col *c, const mpq_t q)
+{
+	int64_t	 num, den;
+
+	num = den = 0;
+	if (mpz_fits_slong_p(mpq_numref(q)) &&
+	    mpz_fits_slong_p(mpq_denref(q))) {
+		num = mpz_get_si(mpq_numref(q));
+		den = mpz_get_si(mpq_denref(q));
+	} else
+		t->inexact++;
+
+	return(col_double(&c[0], mpq_get_d(q)) &&
+	       col_int(&c[1], num) &&
+	       col_int(&c[2], den));
+}
+
+/*
+ * Write a white-space separated vector of rationals (as stored in the
+ * database) into "sz" column triplets starting at "c".
+ * Missing trailing values are written as NaN with a zero denominator.
+ */
+static int
+col_mpqs(struct table *t, struct col *c, size_t sz, const char *v)
+{
+	char	*buf, *sv, *tok;
+	size_t	 i;
+	mpq_t	 q;
+	int	 rc;
+
+	if (NULL == (buf = sv = strdup(NULL == v ? "" : v))) {
+		perror(NULL);
+		return(0);
+	}
+
+	mpq_init(q);
+	rc = 1;
+	i = 0;
+	while (rc && NULL != (tok = strsep(&buf, " \t\n\r"))) {
+		if ('\0' == *tok)
+			continue;
+		if (i == sz) {
+			fprintf(stderr, "%s: too many "
+				"values: %s\n", t->name, v);
+			rc = 0;
+		} else if (-1 == mpq_set_str(q, tok, 10)) {
+			fprintf(stderr, "%s: bad "
+				"rational: %s\n", t->name, tok);
+			rc = 0;
+		} else {
+			mpq_canonicalize(q);
+			rc = col_mpq(t, &c[i * 3], q);
+			i++;
+		}
+	}
+	for ( ; rc && i < sz; i++)
+		rc = col_double(&c[i * 3], NAN) &&
+		     col_int(&c[i * 3 + 1], 0) &&
+		     col_int(&c[i * 3 + 2], 0);
+
+	mpq_clear(q);
+	free(sv);
+	return(rc);
+}
+
+static int
+table_open(struct table *t, const char *out, const char *name)
+{
+
+	memset(t, 0, sizeof(struct table));
+	t->name = name;
+	if (-1 == asprintf(&t->dir, "%s/%s", out, name)) {
+		perror(NULL);
+		return(0);
+	} else if (-1 == mkdir(t->dir, 0755) && EEXIST != errno) {
+		perror(t->dir);
+		return(0);
+	}
+	return(1);
+}
+
+/*
+ * Close out all column files and write the table's manifest, which
+ * has one line per column: name, type, and number of rows.
+ */
+static int
+table_close(struct table *t, int ok)
+{
+	size_t	 i;
+	char	*path;
+	FILE	*f;
+
+	for (i = 0; i < t->colsz; i++) {
+		if (NULL != t->cols[i].f &&
+		    EOF == fclose(t->cols[i].f)) {
+			perror(t->cols[i].name);
+			ok = 0;
+		}
+		t->cols[i].f = NULL;
+	}
+
+	if (ok && t->inexact)
+		fprintf(stderr, "%s: %zu rationals too large for "
+			"exact columns\n", t->name, t->inexact);
+
+	if (ok && -1 == asprintf(&path, "%s/columns", t->dir)) {
+		perror(NULL);
+		ok = 0;
+	} else if (ok) {
+		if (NULL == (f = fopen(path, "w"))) {
+			perror(path);
+			ok = 0;
+		} else {
+			for (i = 0; i < t->colsz; i++)
+				fprintf(f, "%s %s %zu\n",
+					t->cols[i].name,
+					t->cols[i].dbl ?
+					"float64" : "int64",
+					t->cols[i].rows);
+			if (EOF == fclose(f)) {
+				perror(path);
+				ok = 0;
+			}
+		}
+		free(path);
+	}
+
+	for (i = 0; i < t->colsz; i++)
+		free(t->cols[i].name);
+	free(t->cols);
+	free(t->dir);
+	return(ok);
+}
+
+static int
+stmt_prep(sqlite3 *db, sqlite3_stmt **stmt, const char *sql)
+{
+
+	if (SQLITE_OK == sqlite3_prepare_v2(db, sql, -1, stmt, NULL))
+		return(1);
+	fprintf(stderr, "%s: %s\n", sql, sqlite3_errmsg(db));
+	return(0);
+}
+
+/*
+ * Query a single integer value, e.g., a maximum.
+ */
+static int
+query_int(sqlite3 *db, const char *sql, int64_t *v)
+{
+	sqlite3_stmt	*stmt;
+
+	if ( ! stmt_prep(db, &stmt, sql))
+		return(0);
+	*v = SQLITE_ROW == sqlite3_step(stmt) ?
+		sqlite3_column_int64(stmt, 0) : 0;
+	sqlite3_finalize(stmt);
+	return(1);
+}
+
+static int
+export_choices(sqlite3 *db, const char *out)
+{
+	struct table	 t;
+	sqlite3_stmt	*stmt;
+	int64_t		 max;
+	size_t		 i;
+	int		 ok, rc;
+
+	if ( ! query_int(db, "SELECT MAX(stratsz) FROM choice", &max))
+		return(0);
+	if ( ! table_open(&t, out, "choices"))
+		return(0);
+
+	ok = col_add(&t, 0, "round") &&
+	     col_add(&t, 0, "playerid") &&
+	     col_add(&t, 0, "gameid") &&
+	     col_add(&t, 0, "created") &&
+	     col_add(&t, 0, "sessid") &&
+	     col_add(&t, 0, "stratsz");
+	for (i = 0; ok && i < (size_t)max; i++)
+		ok = col_add(&t, 1, "strat%zu", i) &&
+		     col_add(&t, 0, "strat%zu_num", i) &&
+		     col_add(&t, 0, "strat%zu_den", i);
+
+	if ( ! ok || ! stmt_prep(db, &stmt,
+	    "SELECT round,playerid,gameid,created,sessid,"
+	    "stratsz,strats FROM choice "
+	    "ORDER BY round,playerid,gameid"))
+		return(table_close(&t, 0));
+
+	while (ok && SQLITE_ROW == (rc = sqlite3_step(stmt))) {
+		for (i = 0; ok && i < 6; i++)
+			ok = col_int(&t.cols[i],
+				sqlite3_column_int64(stmt, i));
+		if (ok)
+			ok = col_mpqs(&t, &t.cols[6], max,
+				(const char *)
+				sqlite3_column_text(stmt, 6));
+	}
+	if (ok && SQLITE_DONE != rc) {
+		fprintf(stderr, "choices: %s\n", sqlite3_errmsg(db));
+		ok = 0;
+	}
+
+	sqlite3_finalize(stmt);
+	return(table_close(&t, ok));
+}
+
+static int
+export_payoffs(sqlite3 *db, const char *out)
+{
+	struct table	 t;
+	sqlite3_stmt	*stmt;
+	size_t		 i;
+	int		 ok, rc;
+
+	if ( ! table_open(&t, out, "payoffs"))
+		return(0);
+
+	ok = col_add(&t, 0, "round") &&
+	     col_add(&t, 0, "playerid") &&
+	     col_add(&t, 0, "gameid") &&
+	     col_add(&t, 1, "payoff") &&
+	     col_add(&t, 0, "payoff_num") &&
+	     col_add(&t, 0, "payoff_den");
+
+	if ( ! ok || ! stmt_prep(db, &stmt,
+	    "SELECT round,playerid,gameid,payoff FROM payoff "
+	    "ORDER BY round,playerid,gameid"))
+		return(table_close(&t, 0));
+
+	while (ok && SQLITE_ROW == (rc = sqlite3_step(stmt))) {
+		for (i = 0; ok && i < 3; i++)
+			ok = col_int(&t.cols[i],
+				sqlite3_column_int64(stmt, i));
+		if (ok)
+			ok = col_mpqs(&t, &t.cols[3], 1,
+				(const char *)
+				sqlite3_column_text(stmt, 3));
+	}
+	if (ok && SQLITE_DONE != rc) {
+		fprintf(stderr, "payoffs: %s\n", sqlite3_errmsg(db));
+		ok = 0;
+	}
+
+	sqlite3_finalize(stmt);
+	return(table_close(&t, ok));
+}
+
+static int
+export_roundups(sqlite3 *db, const char *out)
+{
+	struct table	 t;
+	sqlite3_stmt	*stmt;
+	int64_t		 p1, p2;
+	size_t		 i;
+	int		 ok, rc;
+
+	if ( ! query_int(db, "SELECT MAX(p1) FROM game", &p1) ||
+	     ! query_int(db, "SELECT MAX(p2) FROM game", &p2))
+		return(0);
+	if ( ! table_open(&t, out, "roundups"))
+		return(0);
+
+	ok = col_add(&t, 0, "round") &&
+	     col_add(&t, 0, "gameid") &&
+	     col_add(&t, 0, "skip") &&
+	     col_add(&t, 0, "plays") &&
+	     col_add(&t, 0, "roundcount");
+	for (i = 0; ok && i < (size_t)p1; i++)
+		ok = col_add(&t, 1, "p1_%zu", i) &&
+		     col_add(&t, 0, "p1_%zu_num", i) &&
+		     col_add(&t, 0, "p1_%zu_den", i);
+	for (i = 0; ok && i < (size_t)p2; i++)
+		ok = col_add(&t, 1, "p2_%zu", i) &&
+		     col_add(&t, 0, "p2_%zu_num", i) &&
+		     col_add(&t, 0, "p2_%zu_den", i);
+
+	if ( ! ok || ! stmt_prep(db, &stmt,
+	    "SELECT round,gameid,skip,plays,roundcount,"
+	    "currentsp1,currentsp2 FROM past "
+	    "ORDER BY round,gameid"))
+		return(table_close(&t, 0));
+
+	while (ok && SQLITE_ROW == (rc = sqlite3_step(stmt))) {
+		for (i = 0; ok && i < 5; i++)
+			ok = col_int(&t.cols[i],
+				sqlite3_column_int64(stmt, i));
+		if (ok)
+			ok = col_mpqs(&t, &t.cols[5], p1,
+				(const char *)
+				sqlite3_column_text(stmt, 5));
+		if (ok)
+			ok = col_mpqs(&t, &t.cols[5 + p1 * 3], p2,
+				(const char *)
+				sqlite3_column_text(stmt, 6));
+	}
+	if (ok && SQLITE_DONE != rc) {
+		fprintf(stderr, "roundups: %s\n", sqlite3_errmsg(db));
+		ok = 0;
+	}
+
+	sqlite3_finalize(stmt);
+	return(table_close(&t, ok));
+}
+
+int
+main(int argc, char *argv[])
+{
+	int		 c, rc;
+	const char	*out;
+	sqlite3		*db;
+
+	out = ".";
+
+	while (-1 != (c = getopt(argc, argv, "o:")))
+		switch (c) {
+		case ('o'):
+			out = optarg;
+			break;
+		default:
+			goto usage;
+		}
+
+	argc -= optind;
+	argv += optind;
+
+	if (1 != argc)
+		goto usage;
+
+	if (-1 == mkdir(out, 0755) && EEXIST != errno) {
+		perror(out);
+		return(EXIT_FAILURE);
+	}
+
+	/*
+	 * The database is a db_backup() snapshot, so we can open it
+	 * read-only and needn't worry about concurrent writers.
+	 */
+	rc = sqlite3_open_v2(argv[0], &db, SQLITE_OPEN_READONLY, NULL);
+	if (SQLITE_OK != rc) {
+		fprintf(stderr, "%s: %s\n", argv[0],
+			NULL != db ? sqlite3_errmsg(db) :
+			sqlite3_errstr(rc));
+		sqlite3_close(db);
+		return(EXIT_FAILURE);
+	}
+
+	rc = export_choices(db, out) &&
+	     export_payoffs(db, out) &&
+	     export_roundups(db, out);
+
+	sqlite3_close(db);
+	return(rc ? EXIT_SUCCESS : EXIT_FAILURE);
+usage:
+	fprintf(stderr, "usage: %s "
+		"[-o dir] "
+		"database\n", getprogname());
+	return(EXIT_FAILURE);
+}
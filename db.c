@@ -15,10 +15,12 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 #include <sys/param.h>
+#include <sys/stat.h>
 
 #include <assert.h>
 #include <inttypes.h>
 #include <math.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -34,10 +36,15 @@
 #include <kcgijson.h>
 #include <gmp.h>
 #include <sqlite3.h>
+#include <zlib.h>
 
 #include "extern.h"
 
 #define DB_STEP_CONSTRAINT 0x01
+#define	BACKUP_PAGES	64 /* pages in first backup step */
+#define	BACKUP_STEPMS	100 /* aim for backup steps this long */
+#define	BACKUP_BUFSZ	(128 * 1024) /* compression buffer */
+#define	BACKUP_GZLEVEL	"6" /* gzip level */
 #define	PLAYER	"player.email,player.state,player.id,player.enabled," \
 		"player.role,player.rseed,player.instr," \
 		"player.finalrank,player.finalscore,player.autoadd," \
@@ -115,20 +122,33 @@ again:
 	exit(EXIT_FAILURE);
 }
 
+static double
+db_now(void)
+{
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return(ts.tv_sec + ts.tv_nsec / 1.0e9);
+}
+
 static int
 db_step(sqlite3_stmt *stmt, unsigned int flags)
 {
-	int	 rc;
-	size_t	 attempt = 0;
+	int		 rc;
+	size_t		 attempt = 0;
+	struct timespec	 t0, t1;
 
 	assert(NULL != stmt);
 	assert(NULL != db);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
 again:
 	rc = sqlite3_step(stmt);
 	if (SQLITE_BUSY == rc) {
+		reqstats.busy++;
 		db_sleep(attempt++);
 		goto again;
 	} else if (SQLITE_LOCKED == rc) {
+		reqstats.busy++;
 		WARNX("sqlite3_step: %s", sqlite3_errmsg(db));
 		db_sleep(attempt++);
 		goto again;
@@ -138,6 +158,14 @@ again:
 		goto again;
 	}
 
+	/* Account for the request, including any lock waits. */
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	reqstats.steps++;
+	reqstats.steptime += (t1.tv_sec - t0.tv_sec) + 
+		(t1.tv_nsec - t0.tv_nsec) / 1.0e9;
+	if (SQLITE_ROW == rc)
+		reqstats.rows++;
+
 	if (SQLITE_DONE == rc || SQLITE_ROW == rc)
 		return(rc);
 	if (SQLITE_CONSTRAINT == rc && DB_STEP_CONSTRAINT & flags)
@@ -170,8 +198,10 @@ again:
 		WARNX("sqlite3_prepare_v2: %s", sqlite3_errmsg(db));
 		db_sleep(attempt++);
 		goto again;
-	} else if (SQLITE_OK == rc)
+	} else if (SQLITE_OK == rc) {
+		reqstats.stmts++;
 		return(stmt);
+	}
 
 	WARNX("sqlite3_prepare_v2: %s (%s)", sqlite3_errmsg(db), sql);
 	sqlite3_finalize(stmt);
@@ -463,6 +493,25 @@ db_winners_free(struct winner *win)
 	free(win);
 }
 
+/*
+ * Wake the round-watcher daemon, if any, to tell it that the round has
+ * (probably) advanced.
+ */
+static void
+db_expr_wake(void)
+{
+	sqlite3_stmt	*stmt;
+	pid_t		 pid = 0;
+
+	stmt = db_stmt("SELECT roundpid FROM experiment");
+	if (SQLITE_ROW == db_step(stmt, 0))
+		pid = sqlite3_column_int64(stmt, 0);
+	sqlite3_finalize(stmt);
+
+	if (pid > 0 && -1 == kill(pid, ROUND_WAKESIG))
+		WARN("kill: round mailer %u", pid);
+}
+
 /*
  * Advance to the next round IFF the experiment has already started and
  * we're in a valid round already.
@@ -478,6 +527,7 @@ db_expr_advanceend(void)
 	db_bind_int(stmt, 1, time(NULL));
 	db_step(stmt, 0);
 	sqlite3_finalize(stmt);
+	db_expr_wake();
 	INFO("Round terminus (attempt) manually");
 }
 
@@ -496,6 +546,7 @@ db_expr_advancenext(void)
 	db_bind_int(stmt, 1, time(NULL));
 	db_step(stmt, 0);
 	sqlite3_finalize(stmt);
+	db_expr_wake();
 	INFO("Round advanced (attempt) manually");
 }
 
@@ -680,6 +731,8 @@ advance:
 	}
 	sqlite3_finalize(stmt);
 	db_expr_free(expr);
+	if (advanced)
+		db_expr_wake();
 	return(advanced);
 }
 
@@ -726,6 +779,72 @@ db_winners_load_all(void *arg, winnerf fp)
 	sqlite3_finalize(stmt);
 }
 
+/*
+ * Queries for each of the exportable tables.
+ * These walk the tables' unique indices, so no sorting is required and
+ * rows may be streamed directly from the cursor.
+ * Each has the type of its result columns, one letter per column: 'i'
+ * for integers and 't' for text (including rational numbers).
+ */
+static	const struct exportq {
+	const char	*query; /* select statement */
+	const char	*types; /* column types */
+} exports[EXPORT__MAX] = {
+	{ "SELECT round,playerid,gameid,stratsz,strats,created,sessid "
+	  "FROM choice ORDER BY round,playerid,gameid",
+	  "iiiitii" }, /* EXPORT_CHOICES */
+	{ "SELECT round,playerid,aggrpayoff,aggrtickets,curpayoff "
+	  "FROM lottery ORDER BY round,playerid",
+	  "iitit" }, /* EXPORT_LOTTERIES */
+	{ "SELECT round,playerid,gameid,payoff "
+	  "FROM payoff ORDER BY round,playerid,gameid",
+	  "iiit" }, /* EXPORT_PAYOFFS */
+	{ "SELECT round,gameid,currentsp1,currentsp2,skip,plays,roundcount "
+	  "FROM past ORDER BY round,gameid",
+	  "iittiii" }, /* EXPORT_ROUNDUPS */
+};
+
+/*
+ * Export all rows of the given table.
+ * The callback is first invoked with the column names and NULL values,
+ * then with the column names and each row's values (NULL values are
+ * passed as the empty string).
+ * It's also passed the column types as documented for exports[].
+ * Only a single row is held in memory at any time.
+ */
+void
+db_export(enum export type, exportf fp, void *arg)
+{
+	sqlite3_stmt	 *stmt;
+	const char	**cols, **vals, *types;
+	size_t		  i, sz;
+
+	assert(type < EXPORT__MAX);
+	stmt = db_stmt(exports[type].query);
+	types = exports[type].types;
+	sz = sqlite3_column_count(stmt);
+	assert(strlen(types) == sz);
+	cols = kcalloc(sz, sizeof(char *));
+	vals = kcalloc(sz, sizeof(char *));
+	for (i = 0; i < sz; i++)
+		cols[i] = sqlite3_column_name(stmt, i);
+
+	fp(cols, NULL, types, sz, arg);
+	while (SQLITE_ROW == db_step(stmt, 0)) {
+		for (i = 0; i < sz; i++) {
+			vals[i] = (const char *)
+				sqlite3_column_text(stmt, i);
+			if (NULL == vals[i])
+				vals[i] = "";
+		}
+		fp(cols, vals, types, sz, arg);
+	}
+
+	sqlite3_finalize(stmt);
+	free(cols);
+	free(vals);
+}
+
 /*
  * This computes the ranking and final score (points) awarded to
  * individuals who are playing the lottery; i.e., all players who are
@@ -736,9 +855,10 @@ void
 db_expr_finish(struct expr **expr, size_t count)
 {
 	sqlite3_stmt	*stmt;
-	size_t		 i, j, players;
-	int64_t		*pids;
-	int64_t	 	 total, score, min;
+	size_t		 i, players;
+	int64_t		*pids, *tics;
+	int64_t	 	 total, score, min, round;
+	enum estate	 state;
 	mpq_t		 sum, cmp;
 
 again:
@@ -759,68 +879,93 @@ again:
 	} else if ((*expr)->state >= ESTATE_PREWIN)
 		return;
 
-	mpq_init(sum);
-	mpq_init(cmp);
+	round = (*expr)->rounds - 1;
 	players = db_player_count_all(); /* max players */
 	pids = kcalloc(players, sizeof(int64_t));
+	tics = kcalloc(players, sizeof(int64_t));
 
 	/* 
 	 * Start tallying all the players' payouts.
+	 * We need to force all final-round lottery values to be
+	 * computed: to date, they might not be there.
+	 * Only do so for those that are missing.
 	 * Don't worry about simultaneous updates because the tally will
 	 * be the same in each one.
-	 * Use only Mechanical Turk players.
+	 * Use only non-Mechanical Turk players.
 	 */
 
-	stmt = db_stmt("SELECT id FROM player WHERE '' == hitid");
-	for (i = j = 0; SQLITE_ROW == db_step(stmt, 0); i++, j++) {
+	stmt = db_stmt("SELECT id FROM player WHERE '' == hitid "
+		"AND id NOT IN (SELECT playerid FROM lottery "
+		"WHERE round=?)");
+	db_bind_int(stmt, 1, round);
+	for (i = 0; SQLITE_ROW == db_step(stmt, 0); i++) {
 		assert(i < players);
 		pids[i] = sqlite3_column_int64(stmt, 0);
 	}
 	sqlite3_finalize(stmt);
-	assert(i <= players);
-	players = j;
-	
-	if (0 == players)
-		WARNX("No (non-mturk) lottery players for "
-			"computing final scores or rankings");
 
-	if (players) {
-		/*
-		 * First, compute the minimum lottery ticket.
-		 * This will establish whether we need to offset
-		 * negative values.
-		 * To do so, we need to force all lottery values to be
-		 * computed: to date, they might not be there.
-		 */
-		INFO("Forcing lottery computation at end of game...");
-		for (i = 0; i < players; i++) {
+	if (i > 0) {
+		INFO("Forcing lottery computation at end "
+			"of game for %zu players...", i);
+		mpq_init(sum);
+		mpq_init(cmp);
+		while (i-- > 0) {
 			mpq_clear(cmp);
 			mpq_clear(sum);
-			db_player_lottery((*expr)->rounds - 1, 
+			db_player_lottery(round, 
 				pids[i], cmp, sum, &score, count);
 		}
+		mpq_clear(sum);
+		mpq_clear(cmp);
+	}
 
-		/* 
-		 * Now get the minimum ticket.
-		 * If we have a positive ticket, use the standard
-		 * lottery method by zeroing the offset.
-		 */
+	db_trans_begin(1);
 
-		stmt = db_stmt
-			("SELECT MIN(aggrtickets) FROM lottery "
-			 "INNER JOIN player ON player.id=playerid "
-			 "WHERE '' == player.hitid "
-			 "AND lottery.round = ?");
-		db_bind_int(stmt, 1, (*expr)->rounds - 1);
-		db_step(stmt, 0);
-		min = sqlite3_column_int64(stmt, 0);
-		sqlite3_finalize(stmt);
-		if (min >= 0)
-			min = 0;
-		INFO("Payoffs offset (check for negative "
-			"payoffs) is at %" PRId64, min);
-	} else
+	/* Someone may have beaten us to it. */
+
+	stmt = db_stmt("SELECT state FROM experiment");
+	db_step(stmt, 0);
+	state = sqlite3_column_int64(stmt, 0);
+	sqlite3_finalize(stmt);
+	if (state >= ESTATE_PREWIN) {
+		db_trans_rollback();
+		free(pids);
+		free(tics);
+		goto again;
+	}
+
+	/*
+	 * Now read all players' final tickets in one pass, in the order
+	 * that we'll rank them.
+	 * While doing so, compute the minimum ticket.
+	 * This will establish whether we need to offset negative
+	 * values: if we have a positive minimum, use the standard
+	 * lottery method by zeroing the offset.
+	 */
+
+	stmt = db_stmt("SELECT player.id,lottery.aggrtickets "
+		"FROM player LEFT JOIN lottery "
+		"ON lottery.playerid=player.id AND lottery.round=? "
+		"WHERE '' == player.hitid ORDER BY player.id");
+	db_bind_int(stmt, 1, round);
+	for (min = 0, i = 0; SQLITE_ROW == db_step(stmt, 0); i++) {
+		assert(i < players);
+		pids[i] = sqlite3_column_int64(stmt, 0);
+		tics[i] = sqlite3_column_int64(stmt, 1);
+		if (0 == i || tics[i] < min)
+			min = tics[i];
+	}
+	sqlite3_finalize(stmt);
+	players = i;
+
+	if (0 == players)
+		WARNX("No (non-mturk) lottery players for "
+			"computing final scores or rankings");
+
+	if (min >= 0)
 		min = 0;
+	INFO("Payoffs offset (check for negative "
+		"payoffs) is at %" PRId64, min);
 
 	/*
 	 * Set the rank of each player with respect to the total number
@@ -830,6 +975,7 @@ again:
 	 * will have x, then the second x + y, then x + y + z, etc.
 	 * If we have any negative tickets, offset all tickets by the
 	 * minimum negative.
+	 * These are all written within the one transaction.
 	 * NOTE: we're rounding up!
 	 */
 
@@ -837,12 +983,8 @@ again:
 		"finalrank=?,finalscore=?,version=version+1 "
 	        "WHERE id=?");
 	for (total = 0, i = 0; i < players; i++) {
-		mpq_clear(cmp);
-		mpq_clear(sum);
-		db_player_lottery((*expr)->rounds - 1, 
-			pids[i], cmp, sum, &score, count);
 		/* Offset negative (or zero). */
-		score -= min;
+		score = tics[i] - min;
 		db_bind_int(stmt, 1, total);
 		assert(score >= 0);
 		db_bind_int(stmt, 2, score);
@@ -865,12 +1007,79 @@ again:
 	db_step(stmt, 0);
 	sqlite3_finalize(stmt);
 
-	mpq_clear(sum);
-	mpq_clear(cmp);
+	db_trans_commit();
 	free(pids);
+	free(tics);
 	goto again;
 }
 
+/*
+ * A player's range of lottery tickets, [rank, rank + score).
+ */
+struct	ticket {
+	int64_t	 id; /* player identifier */
+	int64_t	 rank; /* first ticket */
+	int64_t	 score; /* number of tickets */
+};
+
+/*
+ * Slot in the hash set of winners.
+ */
+struct	winslot {
+	int64_t	 id; /* player identifier (or zero) */
+	size_t	 rank; /* winning rank plus one */
+};
+
+static int
+ticketcmp(const void *p1, const void *p2)
+{
+	const struct ticket *t1 = p1, *t2 = p2;
+
+	if (t1->rank < t2->rank)
+		return(-1);
+	return(t1->rank > t2->rank);
+}
+
+/*
+ * Binary-search the sorted ticket ranges for the one holding "top".
+ * If none does, return "def".
+ */
+static int64_t
+db_winners_find(const struct ticket *t, size_t sz, int64_t top, int64_t def)
+{
+	size_t	 lo, hi, mid;
+
+	lo = 0;
+	hi = sz;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (top < t[mid].rank)
+			hi = mid;
+		else if (top >= t[mid].rank + t[mid].score)
+			lo = mid + 1;
+		else
+			return(t[mid].id);
+	}
+	return(def);
+}
+
+/*
+ * Look up the hash slot for "id" in the set of size "sz", which must be
+ * a power of two and never full.
+ * This is either the slot holding "id" or the empty slot where it
+ * would be inserted.
+ */
+static struct winslot *
+db_winners_slot(struct winslot *set, size_t sz, int64_t id)
+{
+	size_t	 i;
+
+	i = ((uint64_t)id * 0x9E3779B97F4A7C15ULL) & (sz - 1);
+	while (0 != set[i].id && id != set[i].id)
+		i = (i + 1) & (sz - 1);
+	return(&set[i]);
+}
+
 /*
  * Compute "winnersz" number of lottery winners, using "seed".
  * The number of games is "count".
@@ -881,10 +1090,11 @@ db_winners(struct expr **expr, size_t winnersz, int64_t seed, size_t count)
 {
 	enum estate	 state;
 	sqlite3_stmt	*stmt;
-	size_t		 i, j, players;
-	int64_t		 id, sum, top, score;
-	int64_t		*pids, *winners, *rnums;
-	mpq_t		 div, aggr;
+	size_t		 i, j, players, ticketsz, hashsz;
+	int64_t		 id, last, top, score;
+	int64_t		*pids, *rnums;
+	struct ticket	*tickets;
+	struct winslot	*hash, *slot;
 
 	/* Compute the total count of players. */
 
@@ -912,11 +1122,8 @@ db_winners(struct expr **expr, size_t winnersz, int64_t seed, size_t count)
 	/* Disallow more winners than players. */
 
 	players = db_player_count_all();
-	winners = kcalloc(players, sizeof(int64_t));
 	rnums = kcalloc(winnersz, sizeof(int64_t));
 	pids = kcalloc(players, sizeof(int64_t));
-	mpq_init(div);
-	mpq_init(aggr);
 
 	/* 
 	 * Assign player identifiers.
@@ -942,44 +1149,76 @@ db_winners(struct expr **expr, size_t winnersz, int64_t seed, size_t count)
 	 * seed, which is exactly what we want.
 	 */
 	srandom(seed);
+
+	/*
+	 * Load each player's ticket range once.
+	 * These ranges are disjoint, so we can sort them by their first
+	 * ticket and binary-search for each drawn ticket.
+	 * Ticket-less players can never win, so don't bother keeping
+	 * them around; however, we do remember the last player in the
+	 * historical (random seed) order, which was used if a ticket
+	 * couldn't be matched.
+	 */
+	tickets = kcalloc(players, sizeof(struct ticket));
 	stmt = db_stmt("SELECT id,finalrank,finalscore FROM player "
 		"WHERE '' == hitid ORDER BY rseed ASC, id ASC ");
+	for (id = 0, ticketsz = 0; SQLITE_ROW == db_step(stmt, 0); ) {
+		id = sqlite3_column_int64(stmt, 0);
+		score = sqlite3_column_int64(stmt, 2);
+		assert(score >= 0);
+		if (0 == score)
+			continue;
+		assert(ticketsz < players);
+		tickets[ticketsz].id = id;
+		tickets[ticketsz].rank = sqlite3_column_int64(stmt, 1);
+		tickets[ticketsz].score = score;
+		ticketsz++;
+	}
+	sqlite3_finalize(stmt);
+	last = id;
+	qsort(tickets, ticketsz, sizeof(struct ticket), ticketcmp);
+
+	/*
+	 * Don't try to draw more winners than we have players with
+	 * tickets, else we'd never finish.
+	 */
+	if (winnersz > ticketsz)
+		winnersz = ticketsz;
+
+	/*
+	 * Winners are kept in an open-addressing hash set keyed by
+	 * player identifier (which are always non-zero) and holding the
+	 * winning rank plus one.
+	 * Size it to at least twice the winners.
+	 */
+	for (hashsz = 16; hashsz < winnersz * 2; hashsz <<= 1)
+		continue;
+	hash = kcalloc(hashsz, sizeof(struct winslot));
+
 	for (i = 0; i < winnersz; i++) {
 		/* coverity[dont_call] */
 		top = random() % (*expr)->total;
 		INFO("Winning ticket: %" PRId64, top);
-		id = 0;
-		while (SQLITE_ROW == db_step(stmt, 0)) {
-			id = sqlite3_column_int64(stmt, 0);
-			sum = sqlite3_column_int64(stmt, 1);
-			score = sqlite3_column_int64(stmt, 2);
-			assert(score >= 0);
-			if (top >= sum && top < sum + score)
-				break;
-		}
-		sqlite3_reset(stmt);
+		id = db_winners_find(tickets, ticketsz, top, last);
 		assert(0 != id);
-		for (j = 0; j < i; j++)
-			if (winners[j] == id)
-				break;
-		if (j < i) {
+		slot = db_winners_slot(hash, hashsz, id);
+		if (0 != slot->id) {
 			i--;
 		} else {
-			winners[i] = id;
+			slot->id = id;
+			slot->rank = i + 1;
 			rnums[i] = top;
 			INFO("Winner: player %" PRId64, id);
 		}
 	}
-	sqlite3_finalize(stmt);
 
 	stmt = db_stmt("INSERT INTO winner "
 		"(playerid,winner,winrank,rnum) VALUES (?,?,?,?)");
 	for (i = 0; i < players; i++) {
 		db_bind_int(stmt, 1, pids[i]);
-		for (j = 0; j < winnersz; j++)
-			if (winners[j] == pids[i])
-				break;
-		if (j < winnersz) {
+		slot = db_winners_slot(hash, hashsz, pids[i]);
+		if (0 != slot->id) {
+			j = slot->rank - 1;
 			db_bind_int(stmt, 2, 1);
 			db_bind_int(stmt, 3, j);
 			db_bind_int(stmt, 4, rnums[j]);
@@ -1001,10 +1240,9 @@ db_winners(struct expr **expr, size_t winnersz, int64_t seed, size_t count)
 	INFO("All lottery winners computed!");
 
 	db_trans_commit();
-	mpq_clear(div);
-	mpq_clear(aggr);
 	free(pids);
-	free(winners);
+	free(tickets);
+	free(hash);
 	free(rnums);
 	return(1);
 }
@@ -1330,29 +1568,28 @@ void
 db_player_load_highest(playerscorefp fp, void *arg, size_t limit)
 {
 	sqlite3_stmt	*stmt;
-	struct player	*player;
+	struct player	 player;
+	size_t		 pos;
 	mpq_t		 aggr;
 
-	if (limit > 0) {
-		stmt = db_stmt("SELECT playerid,max(aggrtickets),"
-			"aggrpayoff FROM lottery "
-			"GROUP BY playerid "
-			"ORDER BY aggrtickets DESC LIMIT ?");
-		db_bind_int(stmt, 1, limit);
-	} else
-		stmt = db_stmt("SELECT playerid,max(aggrtickets),"
-			"aggrpayoff FROM lottery "
-			"GROUP BY playerid "
-			"ORDER BY aggrtickets DESC");
+	/*
+	 * The leaderboard is indexed by ticket count, so this is a
+	 * short walk down the index, not a full aggregation.
+	 * A negative limit is no limit at all.
+	 */
+	stmt = db_stmt("SELECT " PLAYER ",leader.aggrtickets,"
+		"leader.aggrpayoff FROM leader "
+		"INNER JOIN player ON player.id=leader.playerid "
+		"ORDER BY leader.aggrtickets DESC LIMIT ?");
+	db_bind_int(stmt, 1, limit > 0 ? (int64_t)limit : -1);
 
 	while (SQLITE_ROW == db_step(stmt, 0)) {
-		player = db_player_load
-			(sqlite3_column_int64(stmt, 0));
-		assert(NULL != player);
-		mpq_str2mpqinit(sqlite3_column_text(stmt, 2), aggr);
-		fp(player, mpq_get_d(aggr),
-			sqlite3_column_int64(stmt, 1), arg);
-		db_player_free(player);
+		pos = 0;
+		db_player_fill(&player, &pos, stmt);
+		mpq_str2mpqinit(sqlite3_column_text(stmt, pos + 1), aggr);
+		fp(&player, mpq_get_d(aggr),
+			sqlite3_column_int64(stmt, pos), arg);
+		db_player_clear(&player);
 		mpq_clear(aggr);
 	}
 
@@ -1360,43 +1597,121 @@ db_player_load_highest(playerscorefp fp, void *arg, size_t limit)
 }
 
 /*
- * Load all Mechanical Turk players who have finished their sequence of
- * play and need to receive bonuses.
+ * Create the bonus ledger entries for all Mechanical Turk players who
+ * have finished their sequence of play and need to receive bonuses.
+ * Existing entries are left as-is, so this may be called any number of
+ * times.
+ * Returns the number of bonuses not yet granted.
  */
-struct player **
-db_player_load_bonuses(int64_t **scores, size_t *sz)
+size_t
+db_bonus_prime(void)
 {
-	sqlite3_stmt	 *stmt;
-	struct player	**player;
-	size_t		  i;
+	sqlite3_stmt	*stmt;
+	int64_t		 count;
 
-	*sz = 0;
-	stmt = db_stmt("SELECT " PLAYER ",max(lottery.aggrtickets) "
-		"FROM lottery "
+	stmt = db_stmt("INSERT OR IGNORE INTO bonus "
+		"(playerid,token,score,mtime) "
+		"SELECT playerid,player.rseed,"
+		"max(lottery.aggrtickets),? FROM lottery "
 		"INNER JOIN player ON player.id=playerid "
 		"WHERE player.assignmentid != \'\' AND "
 		"player.mturkdone=1 "
 		"GROUP BY playerid");
+	db_bind_int(stmt, 1, time(NULL));
+	db_step(stmt, 0);
+	sqlite3_finalize(stmt);
 
-	player = NULL;
-	*scores = NULL;
+	stmt = db_stmt("SELECT count(*) FROM bonus WHERE state!=?");
+	db_bind_int(stmt, 1, BSTATE_GRANTED);
+	count = SQLITE_ROW == db_step(stmt, 0) ?
+		sqlite3_column_int64(stmt, 0) : 0;
+	sqlite3_finalize(stmt);
+	return(count);
+}
+
+/*
+ * Load all bonuses not yet granted.
+ * This includes those sent without a recorded response, as the
+ * request token keeps them from being paid twice.
+ */
+struct bonus *
+db_bonus_load_pending(size_t *sz)
+{
+	sqlite3_stmt	*stmt;
+	struct bonus	*b = NULL;
+
+	*sz = 0;
+	stmt = db_stmt("SELECT player.email,player.assignmentid,"
+		"bonus.token,bonus.score,bonus.tries,"
+		"bonus.playerid,bonus.id FROM bonus "
+		"INNER JOIN player ON player.id=bonus.playerid "
+		"WHERE bonus.state!=? ORDER BY bonus.id");
+	db_bind_int(stmt, 1, BSTATE_GRANTED);
 
 	while (SQLITE_ROW == db_step(stmt, 0)) {
-		player = kreallocarray
-			(player, *sz + 1,
-			 sizeof(struct player *));
-		*scores = kreallocarray
-			(*scores, *sz + 1,
-			 sizeof(int64_t));
-		player[*sz] = kmalloc(sizeof(struct player));
-		i = 0;
-		db_player_fill(player[*sz], &i, stmt);
-		(*scores)[*sz] = sqlite3_column_int64(stmt, i);
+		b = kreallocarray(b, *sz + 1, sizeof(struct bonus));
+		b[*sz].worker = kstrdup
+			((char *)sqlite3_column_text(stmt, 0));
+		b[*sz].assignmentid = kstrdup
+			((char *)sqlite3_column_text(stmt, 1));
+		b[*sz].token = sqlite3_column_int64(stmt, 2);
+		b[*sz].score = sqlite3_column_int64(stmt, 3);
+		b[*sz].tries = sqlite3_column_int64(stmt, 4);
+		b[*sz].playerid = sqlite3_column_int64(stmt, 5);
+		b[*sz].id = sqlite3_column_int64(stmt, 6);
 		(*sz)++;
 	}
 	sqlite3_finalize(stmt);
+	return(b);
+}
 
-	return(player);
+void
+db_bonus_free(struct bonus *b, size_t sz)
+{
+	size_t	 i;
+
+	for (i = 0; i < sz; i++) {
+		free(b[i].worker);
+		free(b[i].assignmentid);
+	}
+	free(b);
+}
+
+/*
+ * Mark a bonus as being sent.
+ * This must be recorded before the request goes out.
+ */
+void
+db_bonus_sending(int64_t id)
+{
+	sqlite3_stmt	*stmt;
+
+	stmt = db_stmt("UPDATE bonus SET state=?,"
+		"tries=tries+1,mtime=? WHERE id=?");
+	db_bind_int(stmt, 1, BSTATE_SENDING);
+	db_bind_int(stmt, 2, time(NULL));
+	db_bind_int(stmt, 3, id);
+	db_step(stmt, 0);
+	sqlite3_finalize(stmt);
+}
+
+/*
+ * Record the outcome of sending a bonus.
+ * On failure, "response" (which may be NULL) describes why.
+ */
+void
+db_bonus_done(int64_t id, int ok, const char *response)
+{
+	sqlite3_stmt	*stmt;
+
+	stmt = db_stmt("UPDATE bonus SET state=?,"
+		"response=?,mtime=? WHERE id=?");
+	db_bind_int(stmt, 1, ok ? BSTATE_GRANTED : BSTATE_FAILED);
+	db_bind_text(stmt, 2, NULL == response ? "" : response);
+	db_bind_int(stmt, 3, time(NULL));
+	db_bind_int(stmt, 4, id);
+	db_step(stmt, 0);
+	sqlite3_finalize(stmt);
 }
 
 #if 0
@@ -1476,25 +1791,16 @@ db_player_mturkdone(int64_t playerid)
 }
 
 /*
- * This should be invoked for players who are playing.
- * `Plays' values MUST be canonicalised prior to being passed here, and
- * must sum to one.
- * If the player is allowed to play (correct round, etc.), then create a
- * `choice' with their choice and increment the `game-play' counter.
- * This returns zero if we're not in the correct state: player has exceeded
- * their maximum number of plays, game has ended, etc.
- * Otherwise it returns non-zero.
+ * Make sure that the player can play in the given round.
+ * This must be invoked from within a transaction: upon failure, the
+ * transaction is rolled back and zero is returned.
+ * The game identifier is only used for logging.
  */
-int
-db_player_play(const struct player *p, int64_t sessid, 
-	int64_t round, int64_t gameid, mpq_t *plays, size_t sz)
+static int
+db_player_play_check(const struct player *p, 
+	int64_t round, int64_t gameid)
 {
 	struct expr	*expr;
-	sqlite3_stmt	*stmt;
-	int		 rc;
-	char		*buf;
-
-	db_trans_begin(1);
 
 	/*
 	 * Safety checks: make sure we're not playing in an experiment
@@ -1542,12 +1848,25 @@ db_player_play(const struct player *p, int64_t sessid,
 		return(0);
 	}
 	db_expr_free(expr);
+	return(1);
+}
+
+/*
+ * Create our `choice': the mixture of strategies for this given game
+ * and this given round.
+ * Tie that choice to our session (for records-keeping).
+ * This must be invoked from within a transaction: upon failure (the
+ * player has already played), the transaction is rolled back and zero
+ * is returned.
+ */
+static int
+db_player_play_choice(const struct player *p, int64_t sessid, 
+	int64_t round, int64_t gameid, mpq_t *plays, size_t sz)
+{
+	sqlite3_stmt	*stmt;
+	int		 rc;
+	char		*buf;
 
-	/*
-	 * Create our `choice': the mixture of strategies for this given
-	 * game and this given round.
-	 * Tie that choice to our session (for records-keeping).
-	 */
 	buf = mpq_mpq2str(plays, sz);
 	stmt = db_stmt("INSERT INTO choice "
 		"(round,playerid,gameid,strats,stratsz,created,sessid) "
@@ -1570,12 +1889,19 @@ db_player_play(const struct player *p, int64_t sessid,
 			p->id, gameid, round);
 		return(0);
 	}
+	return(1);
+}
+
+/*
+ * First create (this is a no-op if it has already been created) then
+ * update the record of how many `choice' fields we've made for this
+ * round.
+ */
+static void
+db_player_play_count(const struct player *p, int64_t round, size_t count)
+{
+	sqlite3_stmt	*stmt;
 
-	/*
-	 * First create (this is a no-op if it has already been created)
-	 * then update the record of how many `choice' fields we've made
-	 * for this round.
-	 */
 	stmt = db_stmt("INSERT INTO gameplay "
 		"(round,playerid) VALUES (?,?)");
 	db_bind_int(stmt, 1, round);
@@ -1583,13 +1909,64 @@ db_player_play(const struct player *p, int64_t sessid,
 	db_step(stmt, DB_STEP_CONSTRAINT);
 	sqlite3_finalize(stmt);
 	stmt = db_stmt("UPDATE gameplay "
-		"SET choices=choices + 1 "
+		"SET choices=choices + ? "
 		"WHERE round=? AND playerid=?");
-	db_bind_int(stmt, 1, round);
-	db_bind_int(stmt, 2, p->id);
+	db_bind_int(stmt, 1, count);
+	db_bind_int(stmt, 2, round);
+	db_bind_int(stmt, 3, p->id);
 	db_step(stmt, 0);
 	sqlite3_finalize(stmt);
+}
+
+/*
+ * This should be invoked for players who are playing.
+ * `Plays' values MUST be canonicalised prior to being passed here, and
+ * must sum to one.
+ * If the player is allowed to play (correct round, etc.), then create a
+ * `choice' with their choice and increment the `game-play' counter.
+ * This returns zero if we're not in the correct state: player has exceeded
+ * their maximum number of plays, game has ended, etc.
+ * Otherwise it returns non-zero.
+ */
+int
+db_player_play(const struct player *p, int64_t sessid, 
+	int64_t round, int64_t gameid, mpq_t *plays, size_t sz)
+{
+
+	db_trans_begin(1);
+	if ( ! db_player_play_check(p, round, gameid))
+		return(0);
+	if ( ! db_player_play_choice(p, sessid, round, gameid, plays, sz))
+		return(0);
+	db_player_play_count(p, round, 1);
+	db_trans_commit();
+	metrics_add(METRIC_PLAYS, 1);
+	return(1);
+}
+
+/*
+ * Like db_player_play(), but for all mixtures in "mixes" at once.
+ * Either all of the choices are recorded or none of them are: if the
+ * player has already played any one of the games, nothing is changed
+ * and zero is returned.
+ */
+int
+db_player_playall(const struct player *p, int64_t sessid, 
+	int64_t round, const struct mixture *mixes, size_t sz)
+{
+	size_t	 i;
+
+	assert(sz > 0);
+	db_trans_begin(1);
+	if ( ! db_player_play_check(p, round, mixes[0].gameid))
+		return(0);
+	for (i = 0; i < sz; i++)
+		if ( ! db_player_play_choice(p, sessid, round, 
+		    mixes[i].gameid, mixes[i].plays, mixes[i].sz))
+			return(0);
+	db_player_play_count(p, round, sz);
 	db_trans_commit();
+	metrics_add(METRIC_PLAYS, sz);
 	return(1);
 }
 
@@ -2079,6 +2456,7 @@ db_player_join(const struct player *player, int64_t answers)
 	db_step(stmt, 0);
 	sqlite3_finalize(stmt);
 	db_trans_commit();
+	metrics_add(METRIC_JOINS, 1);
 	INFO("Next round (%" PRId64 ") will have %" PRId64 " "
 		"players (max %" PRId64 " per role, role %" PRId64 
 		", had %" PRId64 "): scheduling player %" PRId64 
@@ -2264,39 +2642,78 @@ db_player_set_state(int64_t id, enum pstate state)
 	sqlite3_finalize(stmt);
 }
 
+/*
+ * Write back the results of mailing a batch of new players, as loaded
+ * by db_player_load_new(), in a single transaction.
+ * Players still in PSTATE_NEW (not attempted) are left untouched.
+ */
 void
-db_player_set_mailed(int64_t id, const char *pass)
+db_player_set_mailed_all(const struct newplayer *np, size_t sz)
 {
 	sqlite3_stmt	*stmt;
+	size_t		 i, mailed, errors;
 
+	mailed = errors = 0;
+	db_trans_begin(0);
 	stmt = db_stmt("UPDATE player SET state=?,hash=? WHERE id=?");
-	db_bind_int(stmt, 1, PSTATE_MAILED);
-	db_bind_text(stmt, 2, pass);
-	db_bind_int(stmt, 3, id);
-	db_step(stmt, 0);
+	for (i = 0; i < sz; i++) {
+		if (PSTATE_MAILED == np[i].state)
+			mailed++;
+		else if (PSTATE_ERROR == np[i].state)
+			errors++;
+		else
+			continue;
+		db_bind_int(stmt, 1, np[i].state);
+		db_bind_text(stmt, 2, np[i].pass);
+		db_bind_int(stmt, 3, np[i].id);
+		db_step(stmt, 0);
+		sqlite3_reset(stmt);
+	}
 	sqlite3_finalize(stmt);
-	INFO("Administrator mailed player %" PRId64, id);
+	db_trans_commit();
+	INFO("Administrator mailed %zu players "
+		"(%zu errors)", mailed, errors);
 }
 
-char *
-db_player_next_new(int64_t *id, char **pass)
+/*
+ * Load up to "sz" new (unmailed) players with identifiers greater than
+ * "last" into "np", generating a password for each.
+ * Returns the number loaded, zero when there are none remaining.
+ * The results must be freed with db_newplayer_free().
+ */
+size_t
+db_player_load_new(struct newplayer *np, size_t sz, int64_t last)
 {
 	sqlite3_stmt	*stmt;
-	char		*email;
+	size_t		 i;
 
-	email = *pass = NULL;
 	stmt = db_stmt("SELECT email,id FROM player WHERE "
-		"state=0 AND enabled=1 AND autoadd=0 LIMIT 1");
+		"state=0 AND enabled=1 AND autoadd=0 AND id>? "
+		"ORDER BY id LIMIT ?");
+	db_bind_int(stmt, 1, last);
+	db_bind_int(stmt, 2, sz);
 
-	if (SQLITE_ROW == db_step(stmt, 0)) {
-		email = kstrdup((char *)
+	for (i = 0; i < sz && SQLITE_ROW == db_step(stmt, 0); i++) {
+		np[i].mail = kstrdup((char *)
 			sqlite3_column_text(stmt, 0));
-		*id = sqlite3_column_int64(stmt, 1);
-		*pass = db_crypt_mkpass();
-	} 
+		np[i].id = sqlite3_column_int64(stmt, 1);
+		np[i].pass = db_crypt_mkpass();
+		np[i].state = PSTATE_NEW;
+	}
 
 	sqlite3_finalize(stmt);
-	return(email);
+	return(i);
+}
+
+void
+db_newplayer_free(struct newplayer *np, size_t sz)
+{
+	size_t	 i;
+
+	for (i = 0; i < sz; i++) {
+		free(np[i].mail);
+		free(np[i].pass);
+	}
 }
 
 int
@@ -2352,6 +2769,134 @@ db_player_disable(int64_t id)
 	INFO("Administrator disabled player %" PRId64, id);
 }
 
+/*
+ * Queue outbound mail for the sender (see mail_sendq()).
+ * The "uri" and "loginuri" may be NULL if not used by the mail kind.
+ * Round advance notices also have the last round mailed, "round", and
+ * the round being announced, "target"; otherwise these are -1.
+ */
+void
+db_mailq_add(enum mailq kind, const char *uri, 
+	const char *loginuri, int64_t round, int64_t target)
+{
+	sqlite3_stmt	*stmt;
+
+	stmt = db_stmt("INSERT INTO mailq (kind,uri,"
+		"loginuri,round,target,ctime) VALUES (?,?,?,?,?,?)");
+	db_bind_int(stmt, 1, kind);
+	db_bind_text(stmt, 2, NULL == uri ? "" : uri);
+	db_bind_text(stmt, 3, NULL == loginuri ? "" : loginuri);
+	db_bind_int(stmt, 4, round);
+	db_bind_int(stmt, 5, target);
+	db_bind_int(stmt, 6, time(NULL));
+	db_step(stmt, 0);
+	sqlite3_finalize(stmt);
+	INFO("Mail queue: queued job %" PRId64 " (kind %d)",
+		sqlite3_last_insert_rowid(db), kind);
+}
+
+/*
+ * Number of jobs waiting in the mail queue.
+ */
+size_t
+db_mailq_count(void)
+{
+
+	db_tryopen();
+	return(db_count_all("mailq"));
+}
+
+/*
+ * Get the queued mail job that's next due, whether or not its time has
+ * come, or NULL if the queue is empty.
+ */
+struct mailqjob *
+db_mailq_next(void)
+{
+	sqlite3_stmt	*stmt;
+	struct mailqjob	*job = NULL;
+
+	stmt = db_stmt("SELECT kind,uri,loginuri,round,"
+		"tries,next,ctime,id,rcpts,target FROM mailq "
+		"ORDER BY next ASC, id ASC LIMIT 1");
+
+	if (SQLITE_ROW == db_step(stmt, 0)) {
+		job = kcalloc(1, sizeof(struct mailqjob));
+		job->kind = sqlite3_column_int(stmt, 0);
+		job->uri = kstrdup
+			((char *)sqlite3_column_text(stmt, 1));
+		job->loginuri = kstrdup
+			((char *)sqlite3_column_text(stmt, 2));
+		job->round = sqlite3_column_int64(stmt, 3);
+		job->tries = sqlite3_column_int64(stmt, 4);
+		job->next = sqlite3_column_int64(stmt, 5);
+		job->ctime = sqlite3_column_int64(stmt, 6);
+		job->id = sqlite3_column_int64(stmt, 7);
+		job->rcpts = kstrdup
+			((char *)sqlite3_column_text(stmt, 8));
+		job->target = sqlite3_column_int64(stmt, 9);
+	}
+
+	sqlite3_finalize(stmt);
+	return(job);
+}
+
+void
+db_mailq_free(struct mailqjob *job)
+{
+
+	if (NULL == job)
+		return;
+
+	free(job->uri);
+	free(job->loginuri);
+	free(job->rcpts);
+	free(job);
+}
+
+void
+db_mailq_delete(int64_t id)
+{
+	sqlite3_stmt	*stmt;
+
+	stmt = db_stmt("DELETE FROM mailq WHERE id=?");
+	db_bind_int(stmt, 1, id);
+	db_step(stmt, 0);
+	sqlite3_finalize(stmt);
+}
+
+/*
+ * Narrow a round advance notice to the newline-separated recipients in
+ * "rcpts", e.g., those who weren't reached on this attempt.
+ */
+void
+db_mailq_rcpts(int64_t id, const char *rcpts)
+{
+	sqlite3_stmt	*stmt;
+
+	stmt = db_stmt("UPDATE mailq SET rcpts=? WHERE id=?");
+	db_bind_text(stmt, 1, rcpts);
+	db_bind_int(stmt, 2, id);
+	db_step(stmt, 0);
+	sqlite3_finalize(stmt);
+}
+
+/*
+ * Record a failed attempt at a job, deferring it until "next".
+ */
+void
+db_mailq_retry(int64_t id, time_t next)
+{
+	sqlite3_stmt	*stmt;
+
+	stmt = db_stmt("UPDATE mailq SET "
+		"tries=tries+1,next=? WHERE id=?");
+	db_bind_int(stmt, 1, next);
+	db_bind_int(stmt, 2, id);
+	db_step(stmt, 0);
+	sqlite3_finalize(stmt);
+}
+
 struct smtp *
 db_smtp_get(void)
 {
@@ -2522,6 +3067,32 @@ again:
 	rc = db_step(stmt, DB_STEP_CONSTRAINT);
 	sqlite3_finalize(stmt);
 
+	/*
+	 * Keep the leaderboard current: create the player's entry or
+	 * raise it if we've beaten the previous best.
+	 */
+	if (SQLITE_CONSTRAINT != rc) {
+		stmt = db_stmt("INSERT OR IGNORE INTO leader "
+			"(aggrpayoff,aggrtickets,playerid,round) "
+			"VALUES (?,?,?,?)");
+		db_bind_text(stmt, 1, aggrstr);
+		db_bind_int(stmt, 2, *tics);
+		db_bind_int(stmt, 3, pid);
+		db_bind_int(stmt, 4, round);
+		db_step(stmt, 0);
+		sqlite3_finalize(stmt);
+		stmt = db_stmt("UPDATE leader SET "
+			"aggrpayoff=?,aggrtickets=?,round=? "
+			"WHERE playerid=? AND aggrtickets<?");
+		db_bind_text(stmt, 1, aggrstr);
+		db_bind_int(stmt, 2, *tics);
+		db_bind_int(stmt, 3, round);
+		db_bind_int(stmt, 4, pid);
+		db_bind_int(stmt, 5, *tics);
+		db_step(stmt, 0);
+		sqlite3_finalize(stmt);
+	}
+
 	free(aggrstr);
 	free(curstr);
 	mpq_clear(prevaggr);
@@ -2821,6 +3392,7 @@ db_roundup_game(const struct game *game,
 	mpq_t		 tmp, sum;
 	char		*cursp1, *cursp2;
 	int		 rc;
+	double		 start;
 
 	if (round < 0)
 		return;
@@ -2832,6 +3404,8 @@ again:
 	if (NULL != period->roundups[round])
 		return;
 
+	start = db_now();
+
 	r = kcalloc(1, sizeof(struct roundup));
 	r->round = round;
 	r->p1sz = game->p1;
@@ -2953,6 +3527,7 @@ aggregate:
 	} else {
 		db_roundup_players(round, r, gamesz, game);
 		db_trans_commit();
+		metrics_time(MHIST_ROUNDUP, db_now() - start);
 	}
 
 	free(cursp1);
@@ -3139,6 +3714,30 @@ db_expr_setmturk(const char *accesskey,
 	INFO("Administrator set AWS worker accept: %" PRId64, wpct);
 }
 
+/*
+ * Fill in the "exprround" snapshot polled by the round mailer.
+ * This reads only the round-keeping columns of the experiment.
+ */
+void
+db_expr_getround(struct exprround *er)
+{
+	sqlite3_stmt	*stmt;
+	int		 rc;
+
+	stmt = db_stmt("SELECT state,start,roundbegan,"
+		"round,rounds,minutes,roundpid FROM experiment");
+	rc = db_step(stmt, 0);
+	assert(SQLITE_ROW == rc);
+	er->state = sqlite3_column_int(stmt, 0);
+	er->start = sqlite3_column_int64(stmt, 1);
+	er->roundbegan = sqlite3_column_int64(stmt, 2);
+	er->round = sqlite3_column_int64(stmt, 3);
+	er->rounds = sqlite3_column_int64(stmt, 4);
+	er->minutes = sqlite3_column_int64(stmt, 5);
+	er->roundpid = sqlite3_column_int64(stmt, 6);
+	sqlite3_finalize(stmt);
+}
+
 /*
  * Get a configured experiment.
  * If "only_started" is specified, This will return NULL if the
@@ -3273,6 +3872,10 @@ db_expr_wipe(void)
 	db_exec("DELETE FROM choice");
 	db_exec("DELETE FROM past");
 	db_exec("DELETE FROM lottery");
+	db_exec("DELETE FROM leader");
+	db_exec("DELETE FROM bonus");
+	/* Player and round mail (MAILQ_PLAYERS, MAILQ_ROUND). */
+	db_exec("DELETE FROM mailq WHERE kind=0 OR kind=1");
 	db_exec("DELETE FROM customquestion");
 	db_exec("DELETE FROM winner");
 	db_exec("DELETE FROM player WHERE autoadd=1");
@@ -3306,45 +3909,121 @@ db_expr_wipe(void)
 	INFO("Administrator wiped database");
 }
 
+/*
+ * Stream the file "src" through gzip into "dst".
+ * Returns zero on failure, in which case "dst" may be partial.
+ */
+static int
+db_backup_gzip(const char *src, const char *dst, 
+	size_t *insz, size_t *outsz)
+{
+	FILE		*f;
+	gzFile		 gz;
+	char		*buf;
+	size_t		 sz;
+	int		 ok = 0, erc;
+	struct stat	 st;
+
+	*insz = *outsz = 0;
+	if (NULL == (f = fopen(src, "r"))) {
+		WARN("%s", src);
+		return(0);
+	} else if (NULL == (gz = gzopen(dst, "wb" BACKUP_GZLEVEL))) {
+		WARN("%s", dst);
+		fclose(f);
+		return(0);
+	}
+
+	gzbuffer(gz, BACKUP_BUFSZ);
+	buf = kmalloc(BACKUP_BUFSZ);
+
+	while ((sz = fread(buf, 1, BACKUP_BUFSZ, f)) > 0) {
+		if (gzwrite(gz, buf, sz) != (int)sz) {
+			WARNX("%s: %s", dst, gzerror(gz, &erc));
+			goto out;
+		}
+		*insz += sz;
+	}
+	if (ferror(f)) {
+		WARN("%s", src);
+		goto out;
+	}
+	ok = 1;
+out:
+	if (Z_OK != (erc = gzclose(gz))) {
+		WARNX("%s: gzclose failed (%d)", dst, erc);
+		ok = 0;
+	} else if (-1 != stat(dst, &st))
+		*outsz = st.st_size;
+	fclose(f);
+	free(buf);
+	return(ok);
+}
+
 /*
  * This follows almost exactly from the sqlite3 example.
  * Basically, open a new database and backup the existing database page
  * by page.
  * This (apparently) handles consistency issues.
- * We dont' really care about performance: this is only going to be run
- * after a game has completed.
+ * Steps start at BACKUP_PAGES and are sized so that each holds the
+ * database for around BACKUP_STEPMS, backing off when the database is
+ * busy, so large databases don't crawl while games can still write.
+ * The redacted copy is then gzipped into "zfile" (the uncompressed copy
+ * is written next to it and removed).
  */
 int 
 db_backup(const char *zfile)
 {
-	int		 rc;
+	int		 rc, pages, steps = 0;
 	sqlite3		*pf;
 	sqlite3_backup	*pBackup;
 	sqlite3_stmt	*stmt;
+	char		*tmpfile;
+	double		 start, stepstart, ms;
+	size_t		 insz, outsz;
 
 	INFO("Administrator backing up database: %s", zfile);
 
 	db_tryopen();
+	start = db_now();
+	kasprintf(&tmpfile, "%s.tmp", zfile);
 
-	rc = sqlite3_open(zfile, &pf);
+	rc = sqlite3_open(tmpfile, &pf);
 	if (SQLITE_OK != rc) {
 		WARNX("sqlite3_open: %s", sqlite3_errmsg(pf));
 		goto err;
 	}
 
+	/* A scratch copy: don't bother syncing or journalling it. */
+	sqlite3_exec(pf, "PRAGMA synchronous=OFF", NULL, NULL, NULL);
+	sqlite3_exec(pf, "PRAGMA journal_mode=OFF", NULL, NULL, NULL);
+
 	pBackup = sqlite3_backup_init(pf, "main", db, "main");
 	if (NULL == pBackup) {
 		WARNX("sqlite3_backup_init: %s", sqlite3_errmsg(pf));
 		goto err;
 	}
 
+	pages = BACKUP_PAGES;
 	do {
-		rc = sqlite3_backup_step(pBackup, 5);
+		stepstart = db_now();
+		rc = sqlite3_backup_step(pBackup, pages);
+		ms = (db_now() - stepstart) * 1000.0;
+		steps++;
 		switch (rc) {
 		case (SQLITE_OK):
+			if (ms < BACKUP_STEPMS / 2 && pages < INT32_MAX / 2)
+				pages *= 2;
+			else if (ms > BACKUP_STEPMS * 2 && pages > 1)
+				pages /= 2;
+			/* Let writers in between steps. */
+			sqlite3_sleep(10);
+			break;
 		case (SQLITE_BUSY):
 		case (SQLITE_LOCKED):
-			sqlite3_sleep(250);
+			if (pages > 1)
+				pages /= 2;
+			sqlite3_sleep(BACKUP_STEPMS);
 			break;
 		default:
 			break;
@@ -3429,11 +4108,183 @@ db_backup(const char *zfile)
 	sqlite3_finalize(stmt);
 
 	sqlite3_close(pf);
-	INFO("Administrator backed up database: %s", zfile);
+	pf = NULL;
+
+	if ( ! db_backup_gzip(tmpfile, zfile, &insz, &outsz)) {
+		if (-1 == remove(zfile))
+			WARN("remove: %s", zfile);
+		goto err;
+	}
+	if (-1 == remove(tmpfile))
+		WARN("remove: %s", tmpfile);
+
+	INFO("Administrator backed up database: %s (%zu bytes "
+		"compressed to %zu in %d steps, %.2f seconds)", 
+		zfile, insz, outsz, steps, db_now() - start);
+	free(tmpfile);
 	return(1);
 err:
 	sqlite3_close(pf);
-	if (-1 == remove(zfile))
-		WARN("remove: %s", zfile);
+	if (-1 == remove(tmpfile))
+		WARN("remove: %s", tmpfile);
+	free(tmpfile);
 	return(0);
 }
+
+static	const char *const backuptabs[BACKUP__MAX] = {
+	"choice", /* BACKUP_CHOICE */
+	"payoff", /* BACKUP_PAYOFF */
+	"lottery", /* BACKUP_LOTTERY */
+};
+
+/*
+ * Fill "marks" with the largest row identifier of each backuptab, that
+ * is, where incremental backups should start.
+ */
+void
+db_backup_marks(int64_t *marks)
+{
+	sqlite3_stmt	*stmt;
+	char		 buf[128];
+	size_t		 i;
+
+	db_tryopen();
+	for (i = 0; i < BACKUP__MAX; i++) {
+		(void)snprintf(buf, sizeof(buf), 
+			"SELECT max(id) FROM %s", backuptabs[i]);
+		stmt = db_stmt(buf);
+		db_step(stmt, 0);
+		marks[i] = sqlite3_column_int64(stmt, 0);
+		sqlite3_finalize(stmt);
+	}
+}
+
+/*
+ * Write the current row of "stmt" from "tab" as an SQL insertion,
+ * skipping the leading identifier column.
+ * Rows are inserted "OR IGNORE" so that overlapping deltas, or a delta
+ * overlapping its base, may be replayed safely.
+ */
+static int
+db_backup_row(gzFile gz, const char *tab, sqlite3_stmt *stmt)
+{
+	const unsigned char *cp, *sp;
+	const unsigned char *blob;
+	int		 i, j, cols, sz;
+
+	cols = sqlite3_column_count(stmt);
+	gzprintf(gz, "INSERT OR IGNORE INTO %s(", tab);
+	for (i = 1; i < cols; i++)
+		gzprintf(gz, "%s%s", i > 1 ? "," : "", 
+			sqlite3_column_name(stmt, i));
+	gzputs(gz, ") VALUES(");
+
+	for (i = 1; i < cols; i++) {
+		if (i > 1)
+			gzputc(gz, ',');
+		switch (sqlite3_column_type(stmt, i)) {
+		case (SQLITE_INTEGER):
+			gzprintf(gz, "%" PRId64, (int64_t)
+				sqlite3_column_int64(stmt, i));
+			break;
+		case (SQLITE_FLOAT):
+			gzprintf(gz, "%.17g", 
+				sqlite3_column_double(stmt, i));
+			break;
+		case (SQLITE_TEXT):
+			/* Quote by doubling single quotes. */
+			sp = sqlite3_column_text(stmt, i);
+			gzputc(gz, '\'');
+			while (NULL != (cp = 
+			       (const unsigned char *)strchr
+			       ((const char *)sp, '\''))) {
+				gzwrite(gz, sp, cp - sp + 1);
+				gzputc(gz, '\'');
+				sp = cp + 1;
+			}
+			gzputs(gz, (const char *)sp);
+			gzputc(gz, '\'');
+			break;
+		case (SQLITE_BLOB):
+			blob = sqlite3_column_blob(stmt, i);
+			sz = sqlite3_column_bytes(stmt, i);
+			gzputs(gz, "X'");
+			for (j = 0; j < sz; j++)
+				gzprintf(gz, "%02x", blob[j]);
+			gzputc(gz, '\'');
+			break;
+		default:
+			gzputs(gz, "NULL");
+			break;
+		}
+	}
+
+	return(gzputs(gz, ");\n") > 0);
+}
+
+/*
+ * Write the rows added to each backuptab since "marks" (see
+ * db_backup_marks()) as gzipped SQL into "zfile", advancing "marks"
+ * past them.
+ * The rows are read in one transaction, so the delta is consistent.
+ * If there are no new rows, "zfile" is not created.
+ * The number of rows written is set in "rows".
+ * Returns zero on failure, in which case "marks" is unchanged and
+ * "zfile" is removed.
+ */
+int
+db_backup_incr(const char *zfile, int64_t *marks, size_t *rows)
+{
+	sqlite3_stmt	*stmt;
+	gzFile		 gz = NULL;
+	char		 buf[128];
+	int64_t		 last[BACKUP__MAX];
+	size_t		 i;
+	int		 ok = 1, erc;
+
+	*rows = 0;
+	db_trans_begin(0);
+	for (i = 0; ok && i < BACKUP__MAX; i++) {
+		last[i] = marks[i];
+		(void)snprintf(buf, sizeof(buf), 
+			"SELECT id,* FROM %s WHERE id > ? "
+			"ORDER BY id", backuptabs[i]);
+		stmt = db_stmt(buf);
+		db_bind_int(stmt, 1, marks[i]);
+		while (ok && SQLITE_ROW == db_step(stmt, 0)) {
+			if (NULL == gz) {
+				gz = gzopen(zfile, "wb" BACKUP_GZLEVEL);
+				if (NULL == gz) {
+					WARN("%s", zfile);
+					ok = 0;
+					break;
+				}
+				gzputs(gz, "BEGIN TRANSACTION;\n");
+			}
+			if ( ! (ok = db_backup_row
+			    (gz, backuptabs[i], stmt)))
+				WARNX("%s: %s", zfile, 
+					gzerror(gz, &erc));
+			last[i] = sqlite3_column_int64(stmt, 0);
+			(*rows)++;
+		}
+		sqlite3_finalize(stmt);
+	}
+	db_trans_commit();
+
+	if (NULL != gz) {
+		if (ok)
+			gzputs(gz, "COMMIT;\n");
+		if (Z_OK != (erc = gzclose(gz))) {
+			WARNX("%s: gzclose failed (%d)", zfile, erc);
+			ok = 0;
+		}
+		if ( ! ok && -1 == remove(zfile))
+			WARN("remove: %s", zfile);
+	}
+
+	if (ok)
+		for (i = 0; i < BACKUP__MAX; i++)
+			marks[i] = last[i];
+	return(ok);
+}
@@ -76,6 +76,28 @@ struct	expr {
 	int64_t		 flags;
 };
 
+/*
+ * The subset of an experiment needed to know when its round advances.
+ * This is much cheaper to read than the full "struct expr".
+ */
+struct	exprround {
+	enum estate	 state; /* state of play */
+	time_t		 start; /* game-play begins */
+	time_t		 roundbegan; /* time that round began */
+	int64_t		 round; /* round (<0 initial, then >=0) */
+	int64_t		 rounds; /* total experiment rounds */
+	int64_t		 minutes; /* minutes per game play */
+	int64_t		 roundpid; /* round-watcher daemon (or 0) */
+};
+
+/*
+ * Signal sent to the round-watcher daemon (see "roundpid") when the
+ * round advances.
+ * Its default disposition is to be ignored, so a stale process
+ * identifier won't kill some other process.
+ */
+#define	ROUND_WAKESIG	 SIGWINCH
+
 /*
  * A user session.
  * The usual web stuff.
@@ -98,6 +120,16 @@ struct	game {
 	int64_t		 id; /* unique identifier */
 };
 
+/*
+ * A player's mixed strategy for a single game.
+ * This is used when playing all games of a round at once.
+ */
+struct	mixture {
+	mpq_t		*plays; /* strategy weights (sum to one) */
+	size_t		 sz; /* number of strategies */
+	int64_t		 gameid; /* game identifier */
+};
+
 /*
  * A roundup consists of the average plays of a game for a particular
  * round.
@@ -149,6 +181,18 @@ enum	pstate {
 	PSTATE_ERROR = 3 /* error in mailing */
 };
 
+/*
+ * A player awaiting the initial mailing of its password.
+ * These are loaded in batches with db_player_load_new() and, once the
+ * mailer has set "state", written back with db_player_set_mailed_all().
+ */
+struct	newplayer {
+	char		*mail; /* e-mail address */
+	char		*pass; /* generated password */
+	int64_t		 id; /* player identifier */
+	enum pstate	 state; /* outcome of mailing */
+};
+
 /*
  * A participant in the game.
  * When the game switches from ESTATE_NEW to ESTATE_STARTED, players are
@@ -188,6 +232,143 @@ struct	smtp {
 	char		*from; /* "from" address on mails */
 };
 
+/*
+ * Kinds of outbound mail in the mail queue.
+ */
+enum	mailq {
+	MAILQ_PLAYERS = 0, /* new-player passwords */
+	MAILQ_ROUND = 1, /* round advance notice */
+	MAILQ_BACKUP = 2, /* database backup */
+	MAILQ_TEST = 3, /* SMTP test */
+	MAILQ__MAX
+};
+
+/*
+ * Counters for the request being served, reset by dbg_request() and
+ * logged by dbg_request_done().
+ */
+struct	reqstats {
+	double		 steptime; /* seconds in db_step() */
+	size_t		 stmts; /* statements prepared */
+	size_t		 steps; /* statements stepped */
+	size_t		 rows; /* result rows stepped */
+	size_t		 busy; /* retries on a busy database */
+	size_t		 mpqs; /* rationals parsed */
+};
+
+/*
+ * Counters kept by metrics_add().
+ */
+enum	metric {
+	METRIC_REQUESTS = 0, /* requests served */
+	METRIC_LOADS = 1, /* participant experiment loads */
+	METRIC_NOTMOD = 2, /* ...answered with a 304 */
+	METRIC_PLAYS = 3, /* plays recorded */
+	METRIC_JOINS = 4, /* participants joining rounds */
+	METRIC_BUSY = 5, /* retries on a busy database */
+	METRIC__MAX
+};
+
+/*
+ * Latency histograms kept by metrics_time().
+ */
+enum	mhist {
+	MHIST_REQUEST = 0, /* request wall time */
+	MHIST_DB = 1, /* request time in the database */
+	MHIST_ROUNDUP = 2, /* computing a game's round-up */
+	MHIST__MAX
+};
+
+#define	METRICS_SECS	61 /* per-second slots kept */
+#define	METRICS_BUCKETS	24 /* log2-microsecond buckets */
+
+/*
+ * Counts during the second "sec".
+ */
+struct	metricslot {
+	int64_t		 sec; /* epoch of slot */
+	uint64_t	 counts[METRIC__MAX];
+};
+
+struct	metrichist {
+	uint64_t	 buckets[METRICS_BUCKETS];
+	uint64_t	 count; /* durations recorded */
+	uint64_t	 sum; /* their sum (microseconds) */
+	uint64_t	 max; /* longest (microseconds) */
+};
+
+/*
+ * Metrics shared by all processes (see metrics.c).
+ */
+struct	metrics {
+	uint32_t	 version; /* layout version */
+	int64_t		 since; /* epoch when (re)started */
+	uint64_t	 totals[METRIC__MAX];
+	struct metricslot slots[METRICS_SECS];
+	struct metrichist hists[MHIST__MAX];
+};
+
+/*
+ * Append-only tables archived by incremental backups.
+ */
+enum	backuptab {
+	BACKUP_CHOICE = 0, /* choice */
+	BACKUP_PAYOFF = 1, /* payoff */
+	BACKUP_LOTTERY = 2, /* lottery */
+	BACKUP__MAX
+};
+
+/*
+ * A job in the outbound mail queue.
+ */
+struct	mailqjob {
+	enum mailq	 kind; /* kind of mail */
+	char		*uri; /* participant login page */
+	char		*loginuri; /* new-participant login */
+	int64_t		 round; /* last round mailed (or -1) */
+	int64_t		 target; /* round announced (or -1) */
+	char		*rcpts; /* recipients left (or empty) */
+	int64_t		 tries; /* failed attempts */
+	time_t		 next; /* don't try before */
+	time_t		 ctime; /* when queued */
+	int64_t		 id; /* unique identifier */
+};
+
+/*
+ * Raw experiment data that may be exported row-by-row.
+ */
+enum	export {
+	EXPORT_CHOICES = 0, /* choice */
+	EXPORT_LOTTERIES, /* lottery */
+	EXPORT_PAYOFFS, /* payoff */
+	EXPORT_ROUNDUPS, /* past */
+	EXPORT__MAX
+};
+
+/*
+ * State of a Mechanical Turk bonus in the ledger.
+ */
+enum	bstate {
+	BSTATE_NEW = 0, /* not yet sent */
+	BSTATE_SENDING = 1, /* sent, no response (yet) */
+	BSTATE_GRANTED = 2, /* paid */
+	BSTATE_FAILED = 3 /* refused or failed */
+};
+
+/*
+ * A Mechanical Turk bonus yet to be granted, along with the
+ * participant details needed to send it.
+ */
+struct	bonus {
+	char		*worker; /* worker identifier (e-mail) */
+	char		*assignmentid; /* assignment identifier */
+	int64_t		 token; /* unique request token */
+	int64_t		 score; /* tickets */
+	int64_t		 tries; /* times sent */
+	int64_t		 playerid; /* participant */
+	int64_t		 id; /* unique identifier */
+};
+
 /*
  * At the end of the game, we create a winning object for each player
  * that records, well, whether they've won or not.
@@ -211,6 +392,14 @@ typedef struct {
         u_int64_t       count;
         unsigned char   buffer[SHA1_BLOCK_LENGTH];
 } SHA1_CTX;
+
+/*
+ * HMAC-SHA1 hash states after the key's inner and outer pads.
+ */
+typedef struct {
+	SHA1_CTX	inner; /* after key XOR ipad */
+	SHA1_CTX	outer; /* after key XOR opad */
+} HMAC_SHA1_CTX;
   
 __BEGIN_DECLS
 
@@ -224,9 +413,12 @@ void 		  SHA1Final(unsigned char[SHA1_DIGEST_LENGTH],
 
 void		  hmac_sha1(const unsigned char *, int,
 			const unsigned char *, int, unsigned char *);
+void		  hmac_sha1_ctx(const HMAC_SHA1_CTX *,
+			const unsigned char *, int, unsigned char *);
+void		  hmac_sha1_init(HMAC_SHA1_CTX *,
+			const unsigned char *, int);
 
-void		  mturk_bonus(const struct expr *, 
-			const struct player *, int64_t);
+void		  mturk_bonuses(const struct expr *);
 void		  mturk_create(const struct expr *, const char *);
 
 void		  base64file(FILE *, size_t, 
@@ -238,6 +430,8 @@ size_t		  base64buf(char *, const char *, size_t);
 int		  doublefork(struct kreq *);
 
 typedef void	(*customqf)(const char *, const char *, void *);
+typedef void	(*exportf)(const char *const *, 
+			const char *const *, const char *, size_t, void *);
 typedef void	(*gamef)(const struct game *, void *);
 typedef void	(*gameroundf)(const struct game *, int64_t, void *);
 typedef void	(*winnerf)(const struct player *, const struct winner *, void *);
@@ -255,11 +449,21 @@ struct sess	*db_admin_sess_alloc(const char *);
 int		 db_admin_sess_valid(int64_t, int64_t);
 
 int		 db_backup(const char *);
+int		 db_backup_incr(const char *, int64_t *, size_t *);
+void		 db_backup_marks(int64_t *);
 
 mpq_t		*db_choices_get(int64_t, int64_t, int64_t, size_t *);
 
+void		 db_bonus_done(int64_t, int, const char *);
+void		 db_bonus_free(struct bonus *, size_t);
+struct bonus	*db_bonus_load_pending(size_t *);
+size_t		 db_bonus_prime(void);
+void		 db_bonus_sending(int64_t);
+
 void		 db_close(void);
 
+void		 db_export(enum export, exportf, void *);
+
 int		 db_expr_advance(void);
 void		 db_expr_advanceend(void);
 void		 db_expr_advancenext(void);
@@ -267,6 +471,7 @@ int		 db_expr_checkstate(enum estate);
 void		 db_expr_finish(struct expr **, size_t);
 void		 db_expr_free(struct expr *);
 struct expr	*db_expr_get(int);
+void		 db_expr_getround(struct exprround *);
 size_t		 db_expr_lobbysize(void);
 void		 db_expr_mturk(const char *, const char *);
 size_t		 db_expr_round_count(const struct expr *, 
@@ -307,6 +512,17 @@ size_t		 db_customq_count(void);
 struct interval	*db_interval_get(int64_t);
 void		 db_interval_free(struct interval *);
 
+void		 db_mailq_add(enum mailq, const char *, 
+			const char *, int64_t, int64_t);
+void		 db_mailq_delete(int64_t);
+void		 db_mailq_free(struct mailqjob *);
+size_t		 db_mailq_count(void);
+struct mailqjob	*db_mailq_next(void);
+void		 db_mailq_rcpts(int64_t, const char *);
+void		 db_mailq_retry(int64_t, time_t);
+
+void		 db_newplayer_free(struct newplayer *, size_t);
+
 int		 db_payoff_get(int64_t, int64_t, int64_t, mpq_t);
 
 size_t		 db_player_count_all(void);
@@ -319,7 +535,6 @@ void		 db_player_enable(int64_t);
 void		 db_player_free(struct player *);
 struct player	*db_player_load(int64_t);
 void		 db_player_load_all(playerf, void *);
-struct player	**db_player_load_bonuses(int64_t **, size_t *);
 void		 db_player_load_playing(const struct expr *, playerf, void *);
 void		 db_player_load_highest(playerscorefp, void *, size_t);
 int		 db_player_lottery(int64_t, int64_t, 
@@ -328,7 +543,7 @@ int		 db_player_mturkvrfy(const char *, char **,
 			const char *, const char *);
 void		 db_player_mturkdone(int64_t);
 int		 db_player_join(const struct player *, int64_t);
-char		*db_player_next_new(int64_t *, char **);
+size_t		 db_player_load_new(struct newplayer *, size_t, int64_t);
 void		 db_player_questionnaire(int64_t, int64_t);
 struct sess	*db_player_sess_alloc(int64_t, const char *);
 int		 db_player_sess_valid(int64_t *, int64_t, int64_t);
@@ -337,11 +552,13 @@ int64_t		 db_player_set_bonus(int64_t);
 #endif
 int		 db_player_play(const struct player *, int64_t, 
 			int64_t, int64_t, mpq_t *, size_t);
+int		 db_player_playall(const struct player *, int64_t, 
+			int64_t, const struct mixture *, size_t);
 void		 db_player_reset_all(void);
 void		 db_player_reset_error(void);
 void		 db_player_set_answered(int64_t, int64_t);
 void		 db_player_set_instr(int64_t, int64_t);
-void		 db_player_set_mailed(int64_t, const char *);
+void		 db_player_set_mailed_all(const struct newplayer *, size_t);
 void		 db_player_set_state(int64_t, enum pstate);
 struct player	*db_player_valid(const char *, const char *);
 
@@ -358,11 +575,8 @@ int		 db_winners(struct expr **, size_t, int64_t, size_t);
 struct winner	*db_winners_get(int64_t);
 void		 db_winners_free(struct winner *);
 
-void		 mail_players(const char *, const char *);
-void		 mail_roundadvance(const char *, int64_t, int64_t);
-void		 mail_backup(void);
+void		 mail_sendq(void);
 void		 mail_wipe(int);
-void		 mail_test(void);
 
 void		 json_puthistory(struct kjsonreq *, int,
 			const struct expr *, struct interval *);
@@ -391,6 +605,17 @@ char		*mpq_mpq2str(mpq_t *, size_t);
 		 dbg_warnx(__FILE__, __LINE__, _fmt, ##__VA_ARGS__)
 #define		 WARN(_fmt, ...) \
 		 dbg_warn(__FILE__, __LINE__, _fmt, ##__VA_ARGS__)
+extern struct reqstats reqstats;
+
+void		 metrics_add(enum metric, uint64_t);
+int		 metrics_read(struct metrics *);
+void		 metrics_reset(void);
+void		 metrics_time(enum mhist, double);
+uint64_t	 metrics_window(const struct metrics *, 
+			enum metric, int64_t);
+
+void		 dbg_request(const char *);
+void		 dbg_request_done(void);
 void		 dbg_info(const char *, size_t, const char *, ...)
 			__attribute__((format(printf, 3, 4)));
 void		 dbg_warn(const char *, size_t, const char *, ...)
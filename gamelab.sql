@@ -147,6 +147,57 @@ CREATE TABLE lottery (
 	UNIQUE (round, playerid)
 );
 
+-- The leaderboard keeps, for each @player having any @lottery, the
+-- highest @lottery.aggrtickets over all rounds and the corresponding
+-- @lottery.aggrpayoff.
+-- It's maintained as lottery rows are created so that the top players
+-- can be listed without aggregating the full @lottery table.
+
+CREATE TABLE leader (
+	-- The participant.
+	playerid INTEGER REFERENCES player(id) NOT NULL,
+	-- The highest @lottery.aggrtickets for the participant.
+	aggrtickets INTEGER NOT NULL DEFAULT(0),
+	-- The @lottery.aggrpayoff matching @leader.aggrtickets.
+	aggrpayoff TEXT NOT NULL,
+	-- The @lottery.round matching @leader.aggrtickets.
+	round INTEGER NOT NULL,
+	-- Unique identifier.
+	id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL,
+	UNIQUE (playerid)
+);
+
+CREATE INDEX leader_aggrtickets ON leader (aggrtickets);
+
+-- The ledger of Mechanical Turk bonuses, one row per @player to be
+-- paid, created when bonuses are first requested.
+-- Bonuses are sent until granted, so a run that's been interrupted can
+-- be resumed without paying anybody twice.
+
+CREATE TABLE bonus (
+	-- The participant.
+	playerid INTEGER REFERENCES player(id) NOT NULL,
+	-- The unique request token sent with the bonus (the
+	-- @player.rseed), so that Mechanical Turk itself refuses to
+	-- pay the same bonus twice.
+	token INTEGER NOT NULL,
+	-- The number of tickets (the highest @lottery.aggrtickets) the
+	-- bonus was computed from.
+	score INTEGER NOT NULL,
+	-- The state of the bonus: 0, not yet sent; 1, sent without a
+	-- response (e.g., interrupted); 2, granted; 3, failed.
+	state INTEGER NOT NULL DEFAULT(0),
+	-- The number of times the bonus has been sent.
+	tries INTEGER NOT NULL DEFAULT(0),
+	-- The error of the last failure (or empty).
+	response TEXT NOT NULL DEFAULT(''),
+	-- The epoch time of the last change in state.
+	mtime INTEGER NOT NULL DEFAULT(0),
+	-- Unique identifier.
+	id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL,
+	UNIQUE (playerid)
+);
+
 -- During a given round, this records a @"player"'s status in terms of
 -- number of @choice rows (plays) made.
 
@@ -502,6 +553,39 @@ CREATE TABLE smtp (
 	id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL
 );
 
+-- Outbound mail waiting to be sent.
+-- Administrative actions (and the round mailer) add to this queue and
+-- return, with a single sender process working through it.
+-- Jobs are removed once sent or, after too many failed attempts, given
+-- up.
+
+CREATE TABLE mailq (
+	-- The kind of mail: 0, new participant passwords; 1, round
+	-- advance notice; 2, database backup; 3, SMTP test.
+	kind INTEGER NOT NULL,
+	-- The participant login page templated into the mail (or empty).
+	uri TEXT NOT NULL DEFAULT(''),
+	-- The login URL for new participants (or empty).
+	loginuri TEXT NOT NULL DEFAULT(''),
+	-- For round advance notices, the last round mailed (-1 if
+	-- none).
+	round INTEGER NOT NULL DEFAULT(-1),
+	-- For round advance notices, the round being announced (-1 if
+	-- not a round advance notice).
+	target INTEGER NOT NULL DEFAULT(-1),
+	-- For round advance notices that partly failed, the recipients
+	-- still to be mailed, one per line (empty for all players).
+	rcpts TEXT NOT NULL DEFAULT(''),
+	-- Number of failed attempts at sending.
+	tries INTEGER NOT NULL DEFAULT(0),
+	-- The epoch time before which the job is not to be (re)tried.
+	next INTEGER NOT NULL DEFAULT(0),
+	-- The epoch time at which the job was queued.
+	ctime INTEGER NOT NULL,
+	-- Unique identifier.
+	id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL
+);
+
 INSERT INTO experiment DEFAULT VALUES;
 INSERT INTO smtp DEFAULT VALUES;
 
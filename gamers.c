@@ -14,17 +14,26 @@
  * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
-#include <sys/queue.h>
-#include <sys/select.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <sys/types.h>
+#include <sys/event.h>
+#endif
+#include <sys/resource.h>
 #include <sys/time.h>
+#include <sys/wait.h>
 
 #include <assert.h>
+#include <errno.h>
 #include <getopt.h>
 #include <math.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <json-c/json.h>
@@ -42,12 +51,116 @@ enum	phase {
 	PHASE__MAX
 };
 
+/*
+ * Delays a gamer may take before a connection.
+ */
+enum	delay {
+	DELAY_WAIT = 0, /* between any connections */
+	DELAY_POLL, /* re-loading the experiment */
+	DELAY_THINK, /* before playing a new round */
+	DELAY__MAX
+};
+
+static	const char *const delaynames[DELAY__MAX] = {
+	"wait", /* DELAY_WAIT */
+	"poll", /* DELAY_POLL */
+	"think", /* DELAY_THINK */
+};
+
+/*
+ * Distributions of delays, in seconds.
+ */
+enum	disttype {
+	DIST_NONE = 0, /* unset (inherit, or no delay) */
+	DIST_FIXED, /* always "a" */
+	DIST_UNIFORM, /* between "a" and "b" */
+	DIST_EXP, /* exponential with mean "a" */
+	DIST_NORMAL, /* mean "a", deviation "b" */
+	DIST_LOGNORMAL, /* median "a", log deviation "b" */
+	DIST__MAX
+};
+
+static	const char *const distnames[DIST__MAX] = {
+	NULL, /* DIST_NONE */
+	"fixed", /* DIST_FIXED */
+	"uniform", /* DIST_UNIFORM */
+	"exp", /* DIST_EXP */
+	"normal", /* DIST_NORMAL */
+	"lognormal", /* DIST_LOGNORMAL */
+};
+
+struct	dist {
+	enum disttype	 type;
+	double		 a;
+	double		 b;
+};
+
+/*
+ * Maximum points in an arrival curve.
+ */
+#define	ARRIVE_MAX	 64
+
+/*
+ * The shape of the simulated traffic.
+ * This is set from -w and -W or read from a profile file.
+ */
+struct	profile {
+	struct dist	 delays[DELAY__MAX]; /* per-connection delays */
+	double		 arrive[ARRIVE_MAX]; /* arrival times... */
+	double		 arrivepct[ARRIVE_MAX]; /* ...and percent arrived */
+	size_t		 arrivesz; /* points in arrival curve */
+	double		 abandon; /* percent who abandon */
+	double		 late; /* percent who play late... */
+	double		 latewin; /* ...in last seconds of round */
+};
+
+/*
+ * Descriptor events we'll handle per wakeup.
+ */
+#define	EVQ_MAX	 256
+
 struct	stats {
 	size_t	 n;
 	double	 mean;
 	double	 M2;
 };
 
+/*
+ * Latency histogram in the manner of HdrHistogram.
+ * Values are in microseconds, counted exactly below HIST_SUB and then
+ * in HIST_SUB/2 buckets per power of two, so that each bucket is within
+ * 1/64 of the values it holds.
+ * The last bucket (around 38 hours) also holds anything larger.
+ */
+#define	HIST_BITS	 7
+#define	HIST_SUB	 (1 << HIST_BITS)
+#define	HIST_BUCKETS	 (HIST_SUB + 30 * (HIST_SUB / 2))
+
+struct	hist {
+	uint64_t	 n; /* samples */
+	uint64_t	 max; /* largest sample */
+	uint64_t	 counts[HIST_BUCKETS];
+};
+
+/*
+ * Quantiles reported from histograms.
+ */
+#define	QUANTS	 4
+
+static	const double quants[QUANTS] = {
+	0.5, 
+	0.9, 
+	0.99, 
+	0.999
+};
+
+static	const char *const quantnames[QUANTS] = {
+	"p50", 
+	"p90", 
+	"p99", 
+	"p99.9"
+};
+
 /*
  * This will be filled in upon initialisation with the URLs accessed for
  * each gamer phase.
@@ -77,6 +190,7 @@ struct	rstats {
 	time_t		 stamp;
 	struct stats	 rx; /* read bytes */
 	struct stats	 rtt; /* round-trip time */
+	struct hist	 lat; /* round-trip time quantiles */
 	size_t		 plays; /* successful plays */
 	size_t		 firstplays; /* first round played */
 	size_t		 lastplays; /* last round played */
@@ -84,8 +198,6 @@ struct	rstats {
 	struct timeval	 end; /* last round play */
 };
 
-TAILQ_HEAD(gamerq, gamer);
-
 /*
  * The entire game simulation.
  */
@@ -94,20 +206,25 @@ struct	game {
 	int		 verbose; /* verbose operation */
 	int		 compress; /* gzip compression */
 	CURLM		*curl; /* the multi handle */
+	int		 evq; /* epoll or kqueue descriptor */
+	int64_t		 timer; /* multi handle deadline (ms) or -1 */
+	int		 running; /* transfers in progress */
 	struct stats	 total_rx; /* total read bytes */
 	struct stats	 total_rtt; /* total round-trip time */
 	struct stats	 page_rx[PHASE__MAX]; /* per-page reads */
 	struct stats	 page_rtt[PHASE__MAX]; /* per-page rtt */
+	struct hist	 total_lat; /* total rtt quantiles */
+	struct hist	 page_lat[PHASE__MAX]; /* per-page quantiles */
 	struct rstats	*rounds; /* per-round data (incl. -1) */
 	size_t		 roundsz; /* size of `rounds' */
 	size_t		 registered; /* players registered */
 	size_t		 loggedin; /* players logged in */
 	size_t		 players; /* players playing */
-	int		 waitstochastic; /* wait is stochastic */
-	time_t		 wait; /* time for waiting (0 disable) */
-	time_t		 waitmin; /* stochastic waiting min */
-	time_t		 waitmax; /* stochastic waiting max */
-	struct gamerq	 waiting; /* between connections */
+	struct profile	 prof; /* traffic shape */
+	size_t		 abandoned; /* players who abandoned */
+	struct gamer   **heap; /* between connections (min-heap) */
+	size_t		 heapsz; /* gamers in `heap' */
+	size_t		 worker; /* worker number (with -j) */
 	int		 fixunit; /* fix units when outputting */
 	int		 equal;
 	int		 random;
@@ -154,11 +271,12 @@ struct	gamer {
 	int64_t			 lastround; /* last seen round */
 	int64_t			 firstplays; /* first round played */
 	int64_t			 role; /* what role we're playing */
-	size_t			 gamecur; /* game being played */
 	size_t		 	 gamemax; /* games to play */
 	struct ginfo		*games; /* per-game info */
-	time_t			 unblock; /* when to unwait */
-	TAILQ_ENTRY(gamer)	 entries;
+	int64_t			 unblock; /* when to unwait (ms) */
+	int			 abandons; /* will abandon */
+	int64_t			 abandon; /* round abandoning or -1 */
+	int			 late; /* plays late in round */
 };
 
 static void
@@ -184,6 +302,213 @@ stddev(const struct stats *s)
 	return(sqrt(s->M2 / (double)(s->n - 1)));
 }
 
+/*
+ * Merge the samples of "o" into "s" (Chan et al.).
+ */
+static void
+stats_merge(struct stats *s, const struct stats *o)
+{
+	double	 delta;
+	size_t	 n;
+
+	if (0 == o->n)
+		return;
+	n = s->n + o->n;
+	delta = o->mean - s->mean;
+	s->mean += delta * (double)o->n / (double)n;
+	s->M2 += o->M2 + delta * delta * 
+		(double)s->n * (double)o->n / (double)n;
+	s->n = n;
+}
+
+/*
+ * Record a duration of "secs" seconds.
+ */
+static void
+hist_add(struct hist *h, double secs)
+{
+	uint64_t	 v;
+	size_t		 i, m;
+
+	v = secs > 0.0 ? (uint64_t)(secs * 1.0e6) : 0;
+	if (v < HIST_SUB)
+		i = v;
+	else {
+		/* Most significant bit, then the top bits below it. */
+		for (m = HIST_BITS; m < 63 && (v >> (m + 1)); m++)
+			continue;
+		i = HIST_SUB + (m - HIST_BITS) * (HIST_SUB / 2) +
+			(v >> (m - HIST_BITS + 1)) - HIST_SUB / 2;
+		if (i >= HIST_BUCKETS)
+			i = HIST_BUCKETS - 1;
+	}
+
+	h->counts[i]++;
+	h->n++;
+	if (v > h->max)
+		h->max = v;
+}
+
+/*
+ * The largest value (in seconds) not exceeded by quantile "q" of the
+ * recorded durations, to within the bucket precision.
+ */
+static double
+hist_quant(const struct hist *h, double q)
+{
+	uint64_t	 want, seen, v;
+	size_t		 i, shift;
+
+	if (0 == h->n)
+		return(0.0);
+	if ((want = ceil(q * (double)h->n)) < 1)
+		want = 1;
+
+	for (seen = 0, i = 0; i < HIST_BUCKETS - 1; i++)
+		if ((seen += h->counts[i]) >= want)
+			break;
+
+	/* The highest value in the bucket. */
+	if (i < HIST_SUB)
+		v = i;
+	else {
+		shift = (i - HIST_SUB) / (HIST_SUB / 2) + 1;
+		v = (((i - HIST_SUB) % (HIST_SUB / 2) + 
+			HIST_SUB / 2 + 1) << shift) - 1;
+	}
+	if (v > h->max || HIST_BUCKETS - 1 == i)
+		v = h->max;
+	return(v / 1.0e6);
+}
+
+/*
+ * Merge the samples of "o" into "h".
+ */
+static void
+hist_merge(struct hist *h, const struct hist *o)
+{
+	size_t	 i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		h->counts[i] += o->counts[i];
+	h->n += o->n;
+	if (o->max > h->max)
+		h->max = o->max;
+}
+
+/*
+ * Merge the round statistics "o" into "s".
+ */
+static void
+rstats_merge(struct rstats *s, const struct rstats *o)
+{
+
+	if (0 == s->stamp || (0 != o->stamp && o->stamp < s->stamp))
+		s->stamp = o->stamp;
+	stats_merge(&s->rx, &o->rx);
+	stats_merge(&s->rtt, &o->rtt);
+	hist_merge(&s->lat, &o->lat);
+	s->plays += o->plays;
+	s->firstplays += o->firstplays;
+	s->lastplays += o->lastplays;
+	if ( ! timerisset(&s->start) || 
+	    (timerisset(&o->start) && timercmp(&o->start, &s->start, <)))
+		s->start = o->start;
+	if (timercmp(&o->end, &s->end, >))
+		s->end = o->end;
+}
+
+/*
+ * Uniform random number in [0, 1).
+ */
+static double
+unif(void)
+{
+
+	return(arc4random() / 4294967296.0);
+}
+
+/*
+ * Standard normal random number (Box-Muller).
+ */
+static double
+gauss(void)
+{
+
+	return(sqrt(-2.0 * log(1.0 - unif())) * cos(2.0 * M_PI * unif()));
+}
+
+/*
+ * Draw a delay from the distribution, in milliseconds.
+ * Negative values (from a normal distribution) are no delay.
+ */
+static int64_t
+dist_sample(const struct dist *d)
+{
+	double	 v;
+
+	switch (d->type) {
+	case (DIST_FIXED):
+		v = d->a;
+		break;
+	case (DIST_UNIFORM):
+		v = d->a + (d->b - d->a) * unif();
+		break;
+	case (DIST_EXP):
+		v = -d->a * log(1.0 - unif());
+		break;
+	case (DIST_NORMAL):
+		v = d->a + d->b * gauss();
+		break;
+	case (DIST_LOGNORMAL):
+		v = d->a * exp(d->b * gauss());
+		break;
+	default:
+		v = 0.0;
+		break;
+	}
+	return(v > 0.0 ? (int64_t)(v * 1000.0) : 0);
+}
+
+/*
+ * Draw an arrival time from the arrival curve, in milliseconds.
+ * The curve is piecewise linear in the percent of players arrived.
+ */
+static int64_t
+arrive_sample(const struct profile *p)
+{
+	double	 pct, frac;
+	size_t	 i;
+
+	if (0 == p->arrivesz)
+		return(0);
+
+	pct = unif() * p->arrivepct[p->arrivesz - 1];
+	for (i = 0; i < p->arrivesz; i++)
+		if (pct < p->arrivepct[i])
+			break;
+	if (0 == i)
+		return((int64_t)(p->arrive[0] * 1000.0));
+	assert(i < p->arrivesz);
+
+	frac = (pct - p->arrivepct[i - 1]) / 
+		(p->arrivepct[i] - p->arrivepct[i - 1]);
+	return((int64_t)(1000.0 * (p->arrive[i - 1] + 
+		frac * (p->arrive[i] - p->arrive[i - 1]))));
+}
+
+/*
+ * Monotonic time in milliseconds, used for all scheduling.
+ */
+static int64_t
+now_ms(void)
+{
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
 static int
 buf_append(struct buf *buf, const char *fmt, ...)
 {
@@ -337,6 +662,47 @@ fmt_bytes(const struct game *g, double b)
 	return(buf);
 }
 
+/*
+ * Print a table header for hist_print(), the first column being "col"
+ * of width "width".
+ */
+static void
+hist_header(const struct game *g, const char *col, int width)
+{
+	size_t	 i;
+
+	if (g->fixunit) {
+		printf("# %s, ", col);
+		for (i = 0; i < QUANTS; i++)
+			printf("%s, ", quantnames[i]);
+		puts("max, samples");
+		return;
+	}
+	printf("%*s ", width, col);
+	for (i = 0; i < QUANTS; i++)
+		printf("%11s ", quantnames[i]);
+	printf("%11s %10s\n", "max", "samples");
+}
+
+/*
+ * Print the quantiles, maximum, and samples of a histogram, finishing
+ * the line.
+ */
+static void
+hist_print(const struct game *g, const struct hist *h)
+{
+	size_t	 i;
+
+	for (i = 0; i < QUANTS; i++) {
+		fputs(fmt_sec(g, hist_quant(h, quants[i])), stdout);
+		putchar(' ');
+	}
+	fputs(fmt_sec(g, h->max / 1.0e6), stdout);
+	putchar(' ');
+	fputs(fmt_samples(g, h->n), stdout);
+	putchar('\n');
+}
+
 /*
  * Make sure the round-statistics array is sized appropriately given the
  * current round, which must be >-2.
@@ -371,7 +737,7 @@ rstats_round(struct game *game, int64_t round)
 			gettimeofday(&rs->end, NULL);
 			timersub(&rs->end, &rs->start, &sub);
 			sec = sub.tv_sec + (sub.tv_usec / 1000000.0);
-			if (game->verbose) {
+			if (game->verbose && 0 == game->worker) {
 				fprintf(stderr, "Round advance: %zd ", 
 					(ssize_t)game->roundsz - 2);
 				fputs(fmt_sec(game, sec), stderr);
@@ -379,7 +745,7 @@ rstats_round(struct game *game, int64_t round)
 				fputs(fmt_bytes(game, rs->rx.mean), stderr);
 				fputc('\n', stderr);
 			}
-		} else if (game->verbose)
+		} else if (game->verbose && 0 == game->worker)
 			fprintf(stderr, "Round advance: %zd\n", 
 				(ssize_t)game->roundsz - 2);
 
@@ -519,6 +885,20 @@ json_getint(const struct gamer *gamer,
 	return(1);
 }
 
+/*
+ * Like json_getint(), but leaving "val" untouched if the value is
+ * missing or not an integer.
+ */
+static void
+json_optint(json_object *parent, int64_t *val, const char *name)
+{
+	json_object	*obj;
+
+	if (json_object_object_get_ex(parent, name, &obj) &&
+	    json_type_int == json_object_get_type(obj))
+		*val = json_object_get_int64(obj);
+}
+
 static int
 json_getstring(const struct gamer *gamer, 
 	json_object *parent, const char **val, const char *name)
@@ -584,35 +964,76 @@ gamer_write(void *ptr, size_t sz, size_t nm, void *arg)
 	return(0);
 }
 
+/*
+ * Put a gamer into the waiting heap until its `unblock' time.
+ * The heap has room for all gamers, as each is in it at most once.
+ */
 static void
 gamer_schedule(struct gamer *g)
 {
-	struct gamer	*gp;
+	struct game	*game = g->game;
+	size_t		 i, up;
 
-	/* 
-	 * Insert us to preserve the fact that the newest entry is going
-	 * to be last.
-	 */
-	TAILQ_FOREACH_REVERSE(gp, &g->game->waiting, gamerq, entries) 
-		if (gp->unblock <= g->unblock) 
+	for (i = game->heapsz++; i > 0; i = up) {
+		up = (i - 1) / 2;
+		if (game->heap[up]->unblock <= g->unblock)
 			break;
-	if (NULL == gp) {
-		TAILQ_INSERT_HEAD(&g->game->waiting, g, entries);
-		return;
+		game->heap[i] = game->heap[up];
+	}
+	game->heap[i] = g;
+}
+
+/*
+ * Remove and return the waiting gamer with the earliest `unblock'.
+ * The heap must not be empty.
+ */
+static struct gamer *
+gamer_wake(struct game *game)
+{
+	struct gamer	*g, *last;
+	size_t		 i, down;
+
+	assert(game->heapsz > 0);
+	g = game->heap[0];
+	last = game->heap[--game->heapsz];
+	for (i = 0; (down = 2 * i + 1) < game->heapsz; i = down) {
+		if (down + 1 < game->heapsz && 
+		    game->heap[down + 1]->unblock < 
+		    game->heap[down]->unblock)
+			down++;
+		if (last->unblock <= game->heap[down]->unblock)
+			break;
+		game->heap[i] = game->heap[down];
 	}
-	TAILQ_INSERT_AFTER(&g->game->waiting, gp, g, entries);
+	game->heap[i] = last;
+	return(g);
+}
+
+/*
+ * How long to wait (in milliseconds) before a connection of the given
+ * kind, which defaults to the generic delay.
+ */
+static int64_t
+gamer_delay(const struct gamer *g, enum delay d)
+{
+	const struct dist *dp;
+
+	dp = &g->game->prof.delays[d];
+	if (DIST_NONE == dp->type)
+		dp = &g->game->prof.delays[DELAY_WAIT];
+	return(dist_sample(dp));
 }
 
 /*
  * Reset the connection for a new run.
  * This means releasing us from the multi handle, resetting the easy
- * connection, then re-adding us to the multi handle.
+ * connection, then re-adding us to the multi handle after "delay"
+ * milliseconds.
  */
 static int
-gamer_reset(struct gamer *g)
+gamer_reset(struct gamer *g, int64_t delay)
 {
 	CURLMcode	 cm;
-	time_t		 t, duration;
 
 	/* First, reset and remove from our connections. */
 	cm = curl_multi_remove_handle(g->game->curl, g->conn);
@@ -624,18 +1045,11 @@ gamer_reset(struct gamer *g)
 	curl_easy_reset(g->conn);
 	
 	/*
-	 * If the game has an inter-connection wait time, then put us in
-	 * the waiting queue for that [minimum] amount of time.
+	 * If we're to wait, then put us in the waiting queue for that
+	 * [minimum] amount of time.
 	 */
-	if (g->game->wait > 0) {
-		t = time(NULL);
-		if (g->game->waitstochastic) {
-			duration = g->game->waitmin +
-				arc4random_uniform
-				(g->game->waitmax - g->game->waitmin);
-		} else 
-			duration = g->game->wait;
-		g->unblock = t + duration;
+	if (delay > 0) {
+		g->unblock = now_ms() + delay;
 		gamer_schedule(g);
 		return(1);
 	}
@@ -699,6 +1113,16 @@ gamer_init(struct gamer *gamer, const char *url, int post)
 		return(0);
 	}
 
+	/* So that finished transfers map back to us. */
+	cc = curl_easy_setopt(gamer->conn, 
+		CURLOPT_PRIVATE, gamer);
+	if (CURLE_OK != cc) {
+		fprintf(stderr, "curl_easy_setopt: "
+			"CURLOPT_PRIVATE: %s\n",
+			curl_easy_strerror(cc));
+		return(0);
+	}
+
 	cc = curl_easy_setopt(gamer->conn, 
 		post ? CURLOPT_POST : CURLOPT_HTTPGET, 1L);
 
@@ -712,16 +1136,70 @@ gamer_init(struct gamer *gamer, const char *url, int post)
 	return(1);
 }
 
+/*
+ * Append the mixture for game "gi" to the POST buffer.
+ * Strategy weights are separated by (URL-encoded) spaces.
+ */
 static int
-gamer_init_play(struct gamer *g, int64_t round)
+gamer_append_mix(struct gamer *g, size_t gi)
 {
 	size_t		 i, sz, cur, v;
 	int	 	 rc;
+
+	rc = buf_append(&g->post, "&mix%" PRId64 "=", g->games[gi].id);
+	if ( ! rc) {
+		fputs("buf_append\n", stderr);
+		return(0);
+	}
+
+	sz = g->games[gi].strats;
+	if (g->game->equal) {
+		for (i = 0; i < sz; i++) {
+			rc = buf_append(&g->post, "%s1/%zu", 
+				i > 0 ? "%20" : "", sz);
+			if ( ! rc) {
+				fputs("buf_append\n", stderr);
+				return(0);
+			}
+		}
+	} else if (g->game->random) {
+		cur = 1000;
+		for (i = 0; i < sz - 1; i++) {
+			v = arc4random_uniform(cur);
+			rc = buf_append(&g->post, "%s%zu/1000", 
+				i > 0 ? "%20" : "", v);
+			if ( ! rc) {
+				fputs("buf_append\n", stderr);
+				return(0);
+			}
+			cur -= v;
+		}
+		rc = buf_append(&g->post, "%s%zu/1000", 
+			i > 0 ? "%20" : "", cur);
+		if ( ! rc) {
+			fputs("buf_append\n", stderr);
+			return(0);
+		}
+	} else if ( ! buf_append(&g->post, "1")) {
+		fputs("buf_append\n", stderr);
+		return(0);
+	}
+	return(1);
+}
+
+/*
+ * Play all games of the round in a single request.
+ */
+static int
+gamer_init_play(struct gamer *g, int64_t round)
+{
+	size_t		 i;
+	int	 	 rc;
 	CURLcode	 cc;
 
 	g->phase = PHASE_PLAY;
 
-	assert(g->gamecur < g->gamemax);
+	assert(g->gamemax > 0);
 
 	/* Start with the URL for the captive portal. */
 	if ( ! gamer_init(g, urls[PHASE_PLAY], 1)) {
@@ -743,45 +1221,15 @@ gamer_init_play(struct gamer *g, int64_t round)
 		return(0);
 	}
 
-	rc = buf_write(&g->post, "round=%" PRId64 "&gid=%" 
-		PRId64, round, g->games[g->gamecur].id);
-	if ( ! rc) {
+	if ( ! buf_write(&g->post, "round=%" PRId64, round)) {
 		fputs("buf_write\n", stderr);
 		return(0);
 	}
-	if (g->game->equal) {
-		sz = g->games[g->gamecur].strats;
-		for (i = 0; i < sz; i++) {
-			rc = buf_append(&g->post, 
-				"&index%zu=1/%zu", i, sz);
-			if ( ! rc) {
-				fputs("buf_append\n", stderr);
-				return(0);
-			}
-		}
-	} else if (g->game->random) {
-		sz = g->games[g->gamecur].strats;
-		cur = 1000;
-		for (i = 0; i < sz - 1; i++) {
-			v = arc4random_uniform(cur);
-			rc = buf_append(&g->post, 
-				"&index%zu=%zu/1000", i, v);
-			if ( ! rc) {
-				fputs("buf_append\n", stderr);
-				return(0);
-			}
-			cur -= v;
-		}
-		rc = buf_append(&g->post, 
-			"&index%zu=%zu/1000", i, cur);
-		if ( ! rc) {
-			fputs("buf_append\n", stderr);
+	for (i = 0; i < g->gamemax; i++)
+		if ( ! gamer_append_mix(g, i)) {
+			fputs("gamer_append_mix\n", stderr);
 			return(0);
 		}
-	} else if ( ! buf_append(&g->post, "&index0=1")) {
-		fputs("buf_append\n", stderr);
-		return(0);
-	}
 
 	/* Add the POST field to the request. */
 	cc = curl_easy_setopt(g->conn, 
@@ -982,7 +1430,8 @@ gamer_phase_play(struct gamer *gamer)
 			curl_easy_strerror(cc));
 		return(0);
 	} else if (409 == code) {
-		if ( ! gamer_reset(gamer)) {
+		if ( ! gamer_reset(gamer, 
+		    gamer_delay(gamer, DELAY_POLL))) {
 			fputs("gamer_reset\n", stderr);
 			return(0);
 		} else if ( ! gamer_init_loadexpr(gamer)) {
@@ -998,29 +1447,17 @@ gamer_phase_play(struct gamer *gamer)
 		fprintf(stderr, "%s: unexpected JSON: %s\n", 
 			gamer->email, gamer->url);
 		return(0);
-	} else if ( ! gamer_reset(gamer)) {
+	} else if ( ! gamer_reset(gamer, 
+	    gamer_delay(gamer, DELAY_POLL))) {
 		fputs("gamer_reset\n", stderr);
 		return(0);
 	} 
 
-	assert(gamer->gamecur < gamer->gamemax);
 	if (gamer->game->verbose > 1)
-		fprintf(stderr, "%s: played game %" PRId64 
-			 "(%zu/%zu), round %" PRId64 "\n", 
-			 gamer->email, 
-			 gamer->games[gamer->gamecur].id, 
-			 gamer->gamecur + 1, gamer->gamemax,
-			 gamer->lastround);
-
-	/* Increment which game in the experiment we're playing. */
-	if (++gamer->gamecur < gamer->gamemax) {
-		if ( ! gamer_init_play(gamer, gamer->lastround)) {
-			fputs("game_init_loadexpr", stderr);
-			return(0);
-		}
-		return(1);
-	}
-	
+		fprintf(stderr, "%s: played %zu games, "
+			 "round %" PRId64 "\n", gamer->email, 
+			 gamer->gamemax, gamer->lastround);
+
 	if ( ! gamer_init_loadexpr(gamer)) {
 		fputs("game_init_loadexpr", stderr);
 		return(0);
@@ -1052,6 +1489,8 @@ gamer_phase_loadexpr(struct gamer *g)
 	CURLcode	    cc;
 	long		    code;
 	int64_t		    round, rounds, joined, prounds;
+	int64_t		    began, minutes, delay;
+	double		    left;
 	struct json_object *expr, *player;
 
 	/* First make sure we have HTTP code 200. */
@@ -1088,6 +1527,11 @@ gamer_phase_loadexpr(struct gamer *g)
 		fputs("json_getint: expr.prounds\n", stderr);
 		return(0);
 	} 
+
+	/* We only need these for playing late in the round. */
+	began = minutes = 0;
+	json_optint(expr, &began, "roundbegan");
+	json_optint(expr, &minutes, "minutes");
 	
 	if ( ! json_getobj(g, g->parsed, &player, "player")) {
 		fputs("json_getobj: player\n", stderr);
@@ -1111,6 +1555,14 @@ gamer_phase_loadexpr(struct gamer *g)
 			return(0);
 		}
 
+	/*
+	 * Players who'll abandon the experiment pick the round in which
+	 * to do so once they know how many there are.
+	 */
+	if (g->abandons && g->abandon < 0 && 
+	    round >= 0 && joined >= 0 && round < rounds)
+		g->abandon = round + arc4random_uniform(rounds - round);
+
 	/*
 	 * Examine the result.
 	 * If we have the same round number as we did before, then keep
@@ -1122,7 +1574,8 @@ gamer_phase_loadexpr(struct gamer *g)
 		 * Experiment hasn't begun yet or we haven't joined the
 		 * game such that we can play.
 		 */
-		if ( ! gamer_reset(g)) {
+		if ( ! gamer_reset(g, 
+		    gamer_delay(g, DELAY_POLL))) {
 			fputs("gamer_reset\n", stderr);
 			return(0);
 		} else if ( ! gamer_init_loadexpr(g)) {
@@ -1159,11 +1612,31 @@ gamer_phase_loadexpr(struct gamer *g)
 		rstats_round(g->game, g->lastround);
 		g->game->rounds[g->lastround + 1].lastplays++;
 		return(1);
+	} else if (g->abandon >= 0 && round >= g->abandon) {
+		/* We've lost interest. */
+		g->game->finished++;
+		g->game->abandoned++;
+		g->phase = PHASE__MAX;
+		if (g->game->verbose > 1)
+			fprintf(stderr, "%s: done (abandoned)\n", 
+				g->email);
+		rstats_round(g->game, g->lastround);
+		g->game->rounds[g->lastround + 1].lastplays++;
+		return(1);
 	} else if (g->lastround < round) {
-		/* Play the round. */
-		g->gamecur = 0;
-		if ( ! gamer_reset(g)) {
-			fputs("gamer_reset\n", stderr);
+		/* 
+		 * Play the round.
+		 * Late players wait until some time in the last part of
+		 * the round (by our clock) instead of thinking.
+		 */
+		delay = gamer_delay(g, DELAY_THINK);
+		if (g->late && began > 0 && minutes > 0) {
+			left = began + minutes * 60 - time(NULL) - 
+				unif() * g->game->prof.latewin;
+			delay = left > 0.0 ? (int64_t)(left * 1000.0) : 0;
+		}
+		if ( ! gamer_reset(g, delay)) {
+			fputs("gamer_reset\n", stderr);
 			return(0);
 		} else if ( ! gamer_init_play(g, round)) {
 			fputs("game_init_play", stderr);
@@ -1178,7 +1651,8 @@ gamer_phase_loadexpr(struct gamer *g)
 	assert(round == g->lastround);
 	assert(round >= 0 && round < rounds);
 	/* We've already played the round. */
-	if ( ! gamer_reset(g)) {
+	if ( ! gamer_reset(g, 
+	    gamer_delay(g, DELAY_POLL))) {
 		fputs("gamer_reset\n", stderr);
 		return(0);
 	} else if ( ! gamer_init_loadexpr(g)) {
@@ -1209,7 +1683,8 @@ gamer_phase_login(struct gamer *gamer)
 			curl_easy_strerror(cc));
 		return(0);
 	} else if (409 == code) {
-		if ( ! gamer_reset(gamer)) {
+		if ( ! gamer_reset(gamer, 
+		    gamer_delay(gamer, DELAY_WAIT))) {
 			fputs("gamer_reset\n", stderr);
 			return(0);
 		} else if ( ! gamer_init_login(gamer)) {
@@ -1272,7 +1747,8 @@ gamer_phase_login(struct gamer *gamer)
 	 * and enter the experiment phase.
 	 */
 
-	if ( ! gamer_reset(gamer)) {
+	if ( ! gamer_reset(gamer, 
+	    gamer_delay(gamer, DELAY_WAIT))) {
 		fputs("gamer_reset\n", stderr);
 		return(0);
 	} else if ( ! gamer_init_loadexpr(gamer)) {
@@ -1312,7 +1788,8 @@ gamer_phase_register(struct gamer *gamer)
 	} else if (404 == code) {
 		fprintf(stderr, "%s: trying again: %s\n", 
 			gamer->email, gamer->url);
-		if ( ! gamer_reset(gamer)) {
+		if ( ! gamer_reset(gamer, 
+		    gamer_delay(gamer, DELAY_WAIT))) {
 			fputs("gamer_reset\n", stderr);
 			return(0);
 		} else if ( ! gamer_init_register(gamer)) {
@@ -1348,7 +1825,8 @@ gamer_phase_register(struct gamer *gamer)
 		return(0);
 	}
 
-	if ( ! gamer_reset(gamer)) {
+	if ( ! gamer_reset(gamer, 
+	    gamer_delay(gamer, DELAY_WAIT))) {
 		fputs("gamer_reset\n", stderr);
 		return(0);
 	} else if ( ! gamer_init_login(gamer)) {
@@ -1395,10 +1873,13 @@ gamer_event(struct gamer *gamer)
 	stats_add(&gamer->game->total_rtt, rtt);
 	stats_add(&gamer->game->page_rx[gamer->phase], rx);
 	stats_add(&gamer->game->page_rtt[gamer->phase], rtt);
+	hist_add(&gamer->game->total_lat, rtt);
+	hist_add(&gamer->game->page_lat[gamer->phase], rtt);
 
 	rstats_round(gamer->game, gamer->lastround);
 	stats_add(&gamer->game->rounds[gamer->lastround + 1].rx, rx);
 	stats_add(&gamer->game->rounds[gamer->lastround + 1].rtt, rtt);
+	hist_add(&gamer->game->rounds[gamer->lastround + 1].lat, rtt);
 
 	switch (gamer->phase) {
 	case (PHASE_REGISTER):
@@ -1427,143 +1908,229 @@ gamer_event(struct gamer *gamer)
 	return(rc);
 }
 
-int
-main(int argc, char *argv[])
+/*
+ * Called by the multi handle when it wants us to watch a different set
+ * of events on a socket: mirror this into the kernel event queue.
+ * We use the socket's multi-handle pointer to remember whether it has
+ * already been added.
+ */
+static int
+game_sock(CURL *e, curl_socket_t s, int what, void *arg, void *sockp)
 {
-	int	 	 c, rc, maxfd, postrun;
-	CURLMsg		*msg;
-	struct timeval	 tv;
-	CURLMcode	 cm;
-	size_t		 i, sz;
-	long		 timeo;
-	char	 	*url, *field;
-	size_t		 urlsz, initwait;
-	struct gamer	*ctx, *gp, *gpt;
-	struct game	 game;
-	fd_set		 rset, wset, eset;
-	unsigned int	 sec;
-	time_t		 t;
+	struct game	   *g = arg;
+#ifdef __linux__
+	struct epoll_event  ev;
 
-	rc = 0;
-	initwait = 0;
-	memset(&game, 0, sizeof(struct game));
-	game.players = 2;
-	TAILQ_INIT(&game.waiting);
+	if (CURL_POLL_REMOVE == what) {
+		/* This fails harmlessly if already closed. */
+		epoll_ctl(g->evq, EPOLL_CTL_DEL, s, NULL);
+		return(0);
+	}
 
-	while (-1 != (c = getopt(argc, argv, "cefrn:vw:W:"))) 
-		switch (c) {
-		case ('c'):
-			game.compress = 1;
-			break;
-		case ('e'):
-			game.equal = 1;
-			break;
-		case ('f'):
-			game.fixunit = 1;
-			break;
-		case ('r'):
-			game.random = 1;
-			break;
-		case ('n'):
-			game.players = atoi(optarg);
-			break;
-		case ('v'):
-			game.verbose++;
-			break;
-		case ('w'):
-			if (NULL != (field = strchr(optarg, ':'))) {
-				*field++ = '\0';
-				game.waitmin = atoi(optarg);
-				game.waitmax = atoi(field);
-				if (game.waitmin >= game.waitmax)
-					goto usage;
-				game.wait = game.waitmax;
-				game.waitstochastic = 1;
-			} else {
-				game.waitstochastic = 0;
-				game.wait = atoi(optarg);
-				if (game.wait < 0) 
-					goto usage;
-			}
-			break;
-		case ('W'):
-			initwait = atoi(optarg);
-			break;
-		default:
-			goto usage;
-		}
+	memset(&ev, 0, sizeof(struct epoll_event));
+	ev.data.fd = s;
+	if (CURL_POLL_IN & what)
+		ev.events |= EPOLLIN;
+	if (CURL_POLL_OUT & what)
+		ev.events |= EPOLLOUT;
 
-	if (game.players < 2) {
-		fputs("-n: need a value >2\n", stderr);
-		goto usage;
+	if (NULL != sockp) {
+		if (-1 == epoll_ctl(g->evq, EPOLL_CTL_MOD, s, &ev)) {
+			perror("epoll_ctl");
+			return(-1);
+		}
+		return(0);
 	}
 
-	argc -= optind;
-	argv += optind;
+	/* 
+	 * A socket re-used by a new connection may still be in the
+	 * queue if we saw it removed after it was closed.
+	 */
+	if (-1 == epoll_ctl(g->evq, EPOLL_CTL_ADD, s, &ev) &&
+	    (EEXIST != errno ||
+	     -1 == epoll_ctl(g->evq, EPOLL_CTL_MOD, s, &ev))) {
+		perror("epoll_ctl");
+		return(-1);
+	}
+	curl_multi_assign(g->curl, s, g);
+	return(0);
+#else
+	struct kevent	    ev;
+
+	/* Deleting filters we never added fails harmlessly. */
+	EV_SET(&ev, s, EVFILT_READ, 
+		CURL_POLL_IN & what ? EV_ADD : EV_DELETE, 0, 0, NULL);
+	if (-1 == kevent(g->evq, &ev, 1, NULL, 0, NULL) &&
+	    CURL_POLL_IN & what) {
+		perror("kevent");
+		return(-1);
+	}
+	EV_SET(&ev, s, EVFILT_WRITE, 
+		CURL_POLL_OUT & what ? EV_ADD : EV_DELETE, 0, 0, NULL);
+	if (-1 == kevent(g->evq, &ev, 1, NULL, 0, NULL) &&
+	    CURL_POLL_OUT & what) {
+		perror("kevent");
+		return(-1);
+	}
+	return(0);
+#endif
+}
 
-	if (0 == argc)
-		goto usage;
+/*
+ * Called by the multi handle when it wants to be woken up (-1 for
+ * never) regardless of socket activity.
+ */
+static int
+game_timer(CURLM *multi, long timeo, void *arg)
+{
+	struct game	*g = arg;
 
-	url = *argv++;
-	argc--;
+	g->timer = timeo < 0 ? -1 : now_ms() + timeo;
+	return(0);
+}
 
-	if (0 == (sz = strlen(url))) {
-		fputs("zero-length url\n", stderr);
-		goto usage;
-	} else if ('/' == url[sz - 1])
-		url[sz - 1] = '\0';
+/*
+ * Wait up to "timeo" milliseconds for socket activity, then pass any
+ * ready sockets to the multi handle.
+ * Returns zero on failure.
+ */
+static int
+game_wait(struct game *g, int timeo)
+{
+	int		    i, n, mask;
+	CURLMcode	    cm;
+	curl_socket_t	    s;
+#ifdef __linux__
+	struct epoll_event  ev[EVQ_MAX];
+
+	n = epoll_wait(g->evq, ev, EVQ_MAX, timeo);
+#else
+	struct kevent	    ev[EVQ_MAX];
+	struct timespec	    ts;
+
+	ts.tv_sec = timeo / 1000;
+	ts.tv_nsec = (timeo % 1000) * 1000000L;
+	n = kevent(g->evq, NULL, 0, ev, EVQ_MAX, &ts);
+#endif
+	if (-1 == n && EINTR == errno)
+		return(1);
+	else if (-1 == n) {
+		perror("event wait");
+		return(0);
+	}
+
+	for (i = 0; i < n; i++) {
+		mask = 0;
+#ifdef __linux__
+		s = ev[i].data.fd;
+		if (EPOLLIN & ev[i].events)
+			mask |= CURL_CSELECT_IN;
+		if (EPOLLOUT & ev[i].events)
+			mask |= CURL_CSELECT_OUT;
+		if ((EPOLLERR | EPOLLHUP) & ev[i].events)
+			mask |= CURL_CSELECT_ERR;
+#else
+		s = ev[i].ident;
+		if (EVFILT_READ == ev[i].filter)
+			mask |= CURL_CSELECT_IN;
+		else if (EVFILT_WRITE == ev[i].filter)
+			mask |= CURL_CSELECT_OUT;
+		if (EV_ERROR & ev[i].flags)
+			mask |= CURL_CSELECT_ERR;
+#endif
+		cm = curl_multi_socket_action
+			(g->curl, s, mask, &g->running);
+		if (CURLM_OK != cm) {
+			fprintf(stderr, "curl_multi_socket_action: %s\n",
+				curl_multi_strerror(cm));
+			return(0);
+		}
+	}
+	return(1);
+}
 
-	urlsz = strlen(url);
+/*
+ * Run the simulation for the game's players, these being numbered from
+ * "first" (for their e-mail addresses) when sharded among workers.
+ * Players arrive and behave according to the game's profile.
+ * Statistics are accumulated in "game".
+ * Returns zero on failure.
+ */
+static int
+game_play(struct game *game, size_t first)
+{
+	int	 	 c, rc;
+	CURLMsg		*msg;
+	CURLMcode	 cm;
+	CURLcode	 cc;
+	size_t		 i;
+	int64_t		 timeo, t, arrive;
+	struct gamer	*ctx, *gp;
 
-	/*
-	 * Create the URLs used for each phase of the simulation.
-	 * These are created from the base URL.
-	 */
-	c = asprintf(&urls[PHASE_REGISTER], "%s/doautoadd.json", url);
-	if (c < 0) {
-		perror(NULL);
-		return(EXIT_FAILURE);
-	}
-	c = asprintf(&urls[PHASE_LOGIN], "%s/dologin.json", url);
-	if (c < 0) {
-		perror(NULL);
-		free(urls[PHASE_REGISTER]);
-		return(EXIT_FAILURE);
-	}
-	c = asprintf(&urls[PHASE_LOADEXPR], "%s/doloadexpr.json", url);
-	if (c < 0) {
-		perror(NULL);
-		free(urls[PHASE_REGISTER]);
-		free(urls[PHASE_LOGIN]);
-		return(EXIT_FAILURE);
-	}
-	c = asprintf(&urls[PHASE_PLAY], "%s/doplay.json", url);
-	if (c < 0) {
-		perror(NULL);
-		free(urls[PHASE_REGISTER]);
-		free(urls[PHASE_LOGIN]);
-		free(urls[PHASE_LOADEXPR]);
-		return(EXIT_FAILURE);
-	}
+	rc = 0;
+	game->timer = -1;
 
 	/*
 	 * Begin by initialising the whole system.
 	 * We won't have enough state to use the `out' label, so free
 	 * memory and state as we go.
 	 */
-	ctx = calloc(game.players, sizeof(struct gamer));
+	ctx = calloc(game->players, sizeof(struct gamer));
 	if (NULL == ctx) {
 		perror(NULL);
-		return(EXIT_FAILURE);
+		return(0);
+	}
+	game->heap = calloc(game->players, sizeof(struct gamer *));
+	if (NULL == game->heap) {
+		perror(NULL);
+		free(ctx);
+		return(0);
+	}
+#ifdef __linux__
+	game->evq = epoll_create1(EPOLL_CLOEXEC);
+#else
+	game->evq = kqueue();
+#endif
+	if (-1 == game->evq) {
+		perror("event queue");
+		free(game->heap);
+		free(ctx);
+		return(0);
 	} else if (CURLE_OK != curl_global_init(CURL_GLOBAL_ALL)) {
 		fputs("curl_global_init\n", stderr);
+		close(game->evq);
+		free(game->heap);
 		free(ctx);
-		return(EXIT_FAILURE);
-	} else if (NULL == (game.curl = curl_multi_init())) {
+		return(0);
+	} else if (NULL == (game->curl = curl_multi_init())) {
 		fputs("curl_global_init\n", stderr);
 		curl_global_cleanup();
+		close(game->evq);
+		free(game->heap);
 		free(ctx);
-		return(EXIT_FAILURE);
+		return(0);
+	}
+
+	/*
+	 * Have the multi handle tell us which sockets to watch and when
+	 * it times out, instead of scanning all of them ourselves.
+	 */
+	if (CURLM_OK != (cm = curl_multi_setopt(game->curl, 
+	     CURLMOPT_SOCKETFUNCTION, game_sock)) ||
+	    CURLM_OK != (cm = curl_multi_setopt(game->curl, 
+	     CURLMOPT_SOCKETDATA, game)) ||
+	    CURLM_OK != (cm = curl_multi_setopt(game->curl, 
+	     CURLMOPT_TIMERFUNCTION, game_timer)) ||
+	    CURLM_OK != (cm = curl_multi_setopt(game->curl, 
+	     CURLMOPT_TIMERDATA, game))) {
+		fprintf(stderr, "curl_multi_setopt: %s\n",
+			curl_multi_strerror(cm));
+		curl_multi_cleanup(game->curl);
+		curl_global_cleanup();
+		close(game->evq);
+		free(game->heap);
+		free(ctx);
+		return(0);
 	}
 
 	/*
@@ -1571,22 +2138,24 @@ main(int argc, char *argv[])
 	 * We have one handle per `player' in the `game'.
 	 * This will allow players to act independently of one another.
 	 */
-	t = time(NULL);
-	for (i = 0; i < game.players; i++) {
+	t = now_ms();
+	for (i = 0; i < game->players; i++) {
 		if (NULL == (ctx[i].conn = curl_easy_init())) {
 			fputs("curl_easy_init\n", stderr);
 			goto out;
 		}
 		ctx[i].lastround = ctx[i].firstplays = -1;
-		ctx[i].game = &game;
+		ctx[i].abandon = -1;
+		ctx[i].game = game;
+		ctx[i].abandons = 100.0 * unif() < game->prof.abandon;
+		ctx[i].late = 100.0 * unif() < game->prof.late;
 
-		if (initwait > 0) {
-			ctx[i].unblock = t + 
-				arc4random_uniform(initwait);
+		if ((arrive = arrive_sample(&game->prof)) > 0) {
+			ctx[i].unblock = t + arrive;
 			gamer_schedule(&ctx[i]);
 		} else {
 			cm = curl_multi_add_handle
-				(game.curl, ctx[i].conn);
+				(game->curl, ctx[i].conn);
 			if (CURLM_OK != cm) {
 				fprintf(stderr, 
 					"curl_multi_add_handle: %s\n",
@@ -1602,7 +2171,8 @@ main(int argc, char *argv[])
 		}
 
 		/* E-mail address: pXX@foo.com. */
-		if (asprintf(&ctx[i].email, "p%zu@foo.com", i) < 0) {
+		if (asprintf(&ctx[i].email, 
+		    "p%zu@foo.com", first + i) < 0) {
 			perror(NULL);
 			goto out;
 		}
@@ -1612,140 +2182,76 @@ main(int argc, char *argv[])
 			fputs("gamer_init_register", stderr);
 			goto out;
 		}
-		if (game.verbose > 1 && initwait)
+		if (game->verbose > 1 && arrive > 0)
 			fprintf(stderr, "%s: trying to "
 				"log in: %lld seconds\n", 
-				ctx[i].email,
-				(long long)(ctx[i].unblock - t));
-		else if (game.verbose > 1)
+				ctx[i].email, (long long)arrive / 1000);
+		else if (game->verbose > 1)
 			fprintf(stderr, "%s: trying to "
 				"log in\n", ctx[i].email);
 	}
 
 	/*
 	 * Event loop.
-	 * Prime our file descriptors for active connections then poll
-	 * the server for data to be transferred.
+	 * The multi handle tells us (game_sock() and game_timer()) which
+	 * sockets to watch and when it wants to run regardless, so each
+	 * wakeup only touches ready connections.
+	 * Gamers between connections wake up from the heap.
+	 * We don't sleep for more than five seconds.
 	 * When a connection has been completed for any given player, we
 	 * pass that into gamer_event() for processing.
 	 */
-	do {
-		FD_ZERO(&eset);
-		FD_ZERO(&rset);
-		FD_ZERO(&wset);
-
-		/* 
-		 * Get file descriptors. 
-		 * These will be maxfd=-1 when we're still preparing
-		 * connections in the very beginning!
-		 */
-		cm = curl_multi_fdset(game.curl, 
-			&rset, &wset, &eset, &maxfd);
-		if (CURLM_OK != cm) {
-			fprintf(stderr, "curl_multi_fdset: %s\n",
-				curl_multi_strerror(cm));
+	while (game->finished < game->players) {
+		t = now_ms();
+		timeo = 5000;
+		if (game->timer >= 0 && game->timer - t < timeo)
+			timeo = game->timer - t;
+		if (game->heapsz > 0 && game->heap[0]->unblock - t < timeo)
+			timeo = game->heap[0]->unblock - t;
+		if (timeo < 0)
+			timeo = 0;
+
+		if ( ! game_wait(game, (int)timeo)) {
+			fputs("game_wait\n", stderr);
 			goto out;
-		} 
-
-		/* 
-		 * How long should we wait?
-		 * If we're told to wait infinitely, then give us a
-		 * hard-coded wait time of five seconds.
-		 */
-		cm = curl_multi_timeout(game.curl, &timeo);
-		if (CURLM_OK != cm) {
-			fprintf(stderr, "curl_multi_timeout: %s\n",
-				curl_multi_strerror(cm));
-			goto out;
-		} else if (-1 == timeo && -1 != maxfd && ! TAILQ_EMPTY(&game.waiting)) {
-			gp = TAILQ_FIRST(&game.waiting);
-			assert(NULL != gp);
-			if ((t = time(NULL)) <= gp->unblock) {
-				if (0 == (sec = gp->unblock - t))
-					sec = 1;
-				else if (sec > 5)
-					sec = 5;
-				timeo = sec;
-			}
 		}
 
-		/*
-		 * Poll on file descriptors.
-		 * We don't do this if we have no file descriptors
-		 * (happens during lookups, etc.) or when we have a
-		 * timeout of zero, which means we need to read data
-		 * now.
-		 */
-		if (-1 != maxfd && timeo > 0) {
-			maxfd++;
-			memset(&tv, 0, sizeof(struct timeval));
-			tv.tv_sec = timeo / 1000;
-			timeo -= tv.tv_sec * 1000;
-			tv.tv_usec = timeo <= 0 ? 0 : timeo * 1000;
-			c = select(maxfd, &rset, &wset, &eset, &tv);
-			if (c < 0) {
-				perror("select");
+		/* The multi handle's timeout has elapsed. */
+		if (game->timer >= 0 && now_ms() >= game->timer) {
+			game->timer = -1;
+			cm = curl_multi_socket_action(game->curl, 
+				CURL_SOCKET_TIMEOUT, 0, &game->running);
+			if (CURLM_OK != cm) {
+				fprintf(stderr, "curl_multi_socket_action: "
+					"%s\n", curl_multi_strerror(cm));
 				goto out;
 			}
-		} else if (-1 == maxfd && ! TAILQ_EMPTY(&game.waiting)) {
-			/*
-			 * If we have no file descriptors to poll on,
-			 * see how long we should wait for the next one.
-			 * We don't wait more than five seconds.
-			 */
-			gp = TAILQ_FIRST(&game.waiting);
-			assert(NULL != gp);
-			if ((t = time(NULL)) <= gp->unblock) {
-				if (0 == (sec = gp->unblock - t))
-					sec = 1;
-				else if (sec > 5)
-					sec = 5;
-				sleep(sec);
-			}
-		} else if (-1 == maxfd)
-			/* 
-			 * We have no file descriptors.
-			 * This seems to happen with CURL is doing its
-			 * iniital DNS queries. 
-			 * Just wait a single second.
-			 */
-			sleep(1);
-
-		/* Actually transfer the data. */
-		do {
-			cm = curl_multi_perform(game.curl, &postrun);
-			if (CURLM_CALL_MULTI_PERFORM == cm ||
-			    CURLM_OK == cm) 
-				continue;
-			fprintf(stderr, "curl_multi_perform: %s\n", 
-				curl_multi_strerror(cm));
-			goto out;
-		} while (CURLM_CALL_MULTI_PERFORM == cm);
+		}
 
 		/* 
 		 * Connections have completed. 
-		 * Loop through to find the connection, map the
-		 * connection to a gamer, then process.
+		 * Map the connection to a gamer, then process.
 		 */
-		for (;;) {
-			msg = curl_multi_info_read(game.curl, &c);
-			if (NULL == msg)
-				break;
-			for (i = 0; i < game.players; i++)
-				if (ctx[i].conn == msg->easy_handle)
-					break;
-			assert(i < game.players);
+		while (NULL != (msg = curl_multi_info_read(game->curl, &c))) {
+			cc = curl_easy_getinfo(msg->easy_handle, 
+				CURLINFO_PRIVATE, (char **)&gp);
+			if (CURLE_OK != cc) {
+				fprintf(stderr, "curl_easy_getinfo: "
+					"CURLINFO_PRIVATE: %s\n",
+					curl_easy_strerror(cc));
+				goto out;
+			}
+			assert(NULL != gp);
 			if (CURLMSG_DONE != msg->msg) {
 				fputs("transfer error\n", stderr);
 				goto out;
 			} else if (CURLE_OK != msg->data.result) {
 				fprintf(stderr, "%s: "
 					"curl_multi_info_read: %s: %s\n", 
-					ctx[i].email,
-					ctx[i].url,
+					gp->email, gp->url,
 					curl_easy_strerror(msg->data.result));
 				goto out;
-			} else if ( ! gamer_event(&ctx[i])) {
+			} else if ( ! gamer_event(gp)) {
 				fputs("gamer_event\n", stderr);
 				goto out;
 			}
@@ -1753,26 +2259,649 @@ main(int argc, char *argv[])
 
 		/*
 		 * Now schedule any waiting connections: pop them off
-		 * the waiting stack and into the connection pool.
+		 * the waiting heap and into the connection pool.
 		 */
-		t = time(NULL);
-		TAILQ_FOREACH_SAFE(gp, &game.waiting, entries, gpt) {
-			if (t <= gp->unblock)
-				continue;
-			TAILQ_REMOVE(&game.waiting, gp, entries);
-			cm = curl_multi_add_handle
-				(gp->game->curl, gp->conn);
+		t = now_ms();
+		while (game->heapsz > 0 && game->heap[0]->unblock <= t) {
+			gp = gamer_wake(game);
+			if (game->verbose > 1) 
+				fprintf(stderr, "%s: unblocking "
+					"for comms: %s\n",
+					gp->email, gp->url);
+			cm = curl_multi_add_handle(game->curl, gp->conn);
 			if (CURLM_OK == cm) 
 				continue;
 			fprintf(stderr, "curl_multi_add_handle: %s\n",
 				curl_multi_strerror(cm));
-			if (game.verbose > 1) 
-				fprintf(stderr, "%s: unblocking "
-					"for comms: %s\n",
-					gp->email, gp->url);
 			goto out;
 		}
-	} while (game.finished < game.players);
+	}
+
+	rc = 1;
+out:
+	/* Memory cleanups and exiting. */
+	for (i = 0; i < game->players; i++) {
+		if (NULL != ctx[i].conn) {
+			curl_multi_remove_handle(game->curl, ctx[i].conn);
+			curl_easy_cleanup(ctx[i].conn);
+		}
+		free(ctx[i].games);
+		free(ctx[i].email);
+		free(ctx[i].password);
+		free(ctx[i].sessid);
+		free(ctx[i].sesscookie);
+		free(ctx[i].post.b);
+		free(ctx[i].cookie.b);
+		json_tokener_free(ctx[i].tok);
+		if (NULL != ctx[i].parsed)
+			json_object_put(ctx[i].parsed);
+	}
+
+	free(ctx);
+	free(game->heap);
+	curl_multi_cleanup(game->curl);
+	curl_global_cleanup();
+	close(game->evq);
+	return(rc);
+}
+
+/*
+ * Read or write exactly "sz" bytes.
+ * Returns zero on failure or (when reading) early end of file.
+ */
+static int
+fullio(int fd, void *buf, size_t sz, int wr)
+{
+	ssize_t	 ssz;
+	char	*cp = buf;
+
+	while (sz > 0) {
+		ssz = wr ? write(fd, cp, sz) : read(fd, cp, sz);
+		if (-1 == ssz && EINTR == errno)
+			continue;
+		else if (-1 == ssz) {
+			perror(wr ? "write" : "read");
+			return(0);
+		} else if (0 == ssz) {
+			fputs("read: unexpected end of file\n", stderr);
+			return(0);
+		}
+		cp += ssz;
+		sz -= ssz;
+	}
+	return(1);
+}
+
+/*
+ * Send a worker's statistics to the parent: the game itself (whose
+ * pointers are meaningless on the other side), then its rounds.
+ */
+static int
+game_send(int fd, struct game *game)
+{
+
+	if ( ! fullio(fd, game, sizeof(struct game), 1))
+		return(0);
+	return(fullio(fd, game->rounds, 
+		game->roundsz * sizeof(struct rstats), 1));
+}
+
+/*
+ * Receive a worker's statistics as sent by game_send() and merge them
+ * into our own.
+ */
+static int
+game_recv(int fd, struct game *game)
+{
+	struct game	 w;
+	struct rstats	*rs;
+	void		*p;
+	size_t		 i;
+
+	if ( ! fullio(fd, &w, sizeof(struct game), 0))
+		return(0);
+
+	if (NULL == (rs = calloc(w.roundsz, sizeof(struct rstats)))) {
+		perror(NULL);
+		return(0);
+	} else if ( ! fullio(fd, rs, 
+		    w.roundsz * sizeof(struct rstats), 0)) {
+		free(rs);
+		return(0);
+	}
+
+	if (w.roundsz > game->roundsz) {
+		p = reallocarray(game->rounds, 
+			w.roundsz, sizeof(struct rstats));
+		if (NULL == p) {
+			perror(NULL);
+			free(rs);
+			return(0);
+		}
+		game->rounds = p;
+		memset(&game->rounds[game->roundsz], 0, 
+			(w.roundsz - game->roundsz) * 
+			sizeof(struct rstats));
+		game->roundsz = w.roundsz;
+	}
+	for (i = 0; i < w.roundsz; i++)
+		rstats_merge(&game->rounds[i], &rs[i]);
+	free(rs);
+
+	stats_merge(&game->total_rx, &w.total_rx);
+	stats_merge(&game->total_rtt, &w.total_rtt);
+	hist_merge(&game->total_lat, &w.total_lat);
+	for (i = 0; i < PHASE__MAX; i++) {
+		stats_merge(&game->page_rx[i], &w.page_rx[i]);
+		stats_merge(&game->page_rtt[i], &w.page_rtt[i]);
+		hist_merge(&game->page_lat[i], &w.page_lat[i]);
+	}
+	game->finished += w.finished;
+	game->abandoned += w.abandoned;
+	game->registered += w.registered;
+	game->loggedin += w.loggedin;
+	return(1);
+}
+
+/*
+ * Shard the game's players among "jobs" worker processes, each with
+ * its own multi handle, so that the client doesn't become the
+ * bottleneck at high player counts.
+ * Each worker sends back its statistics over a pipe when it's done,
+ * and these are merged into "game".
+ * Returns zero on failure, in which case all workers are killed.
+ */
+static int
+game_fork(struct game *game, size_t jobs)
+{
+	pid_t		*pids;
+	int		*fds, fd[2], rc, st;
+	size_t		 i, first;
+	struct game	 w;
+
+	pids = calloc(jobs, sizeof(pid_t));
+	fds = calloc(jobs, sizeof(int));
+	if (NULL == pids || NULL == fds) {
+		perror(NULL);
+		free(pids);
+		free(fds);
+		return(0);
+	}
+
+	rc = 1;
+	for (i = first = 0; i < jobs; i++) {
+		w = *game;
+		w.worker = i;
+		w.players = game->players / jobs + 
+			(i < game->players % jobs ? 1 : 0);
+		if (-1 == pipe(fd)) {
+			perror("pipe");
+			rc = 0;
+			break;
+		} else if (-1 == (pids[i] = fork())) {
+			perror("fork");
+			close(fd[0]);
+			close(fd[1]);
+			pids[i] = 0;
+			rc = 0;
+			break;
+		} else if (0 == pids[i]) {
+			close(fd[0]);
+			st = game_play(&w, first) &&
+				game_send(fd[1], &w);
+			_exit(st ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+		close(fd[1]);
+		fds[i] = fd[0];
+		first += w.players;
+	}
+
+	if (game->verbose)
+		fprintf(stderr, "Started %zu workers.\n", i);
+
+	/* 
+	 * Workers write only when done, so simply read them in order.
+	 * If any fail, there's no point in waiting for the others.
+	 */
+	for (i = 0; i < jobs && 0 != pids[i]; i++) {
+		if (rc && ! game_recv(fds[i], game)) {
+			fprintf(stderr, "worker %zu failed\n", i);
+			rc = 0;
+		}
+		close(fds[i]);
+	}
+	for (i = 0; i < jobs && 0 != pids[i]; i++) {
+		if ( ! rc)
+			kill(pids[i], SIGTERM);
+		if (-1 == waitpid(pids[i], &st, 0)) {
+			perror("waitpid");
+			rc = 0;
+		} else if ( ! WIFEXITED(st) || 
+		           EXIT_SUCCESS != WEXITSTATUS(st))
+			rc = 0;
+	}
+
+	free(pids);
+	free(fds);
+	return(rc);
+}
+
+/*
+ * Write the statistics "name" as a JSON object member, with quantiles
+ * if "h" is not NULL.
+ */
+static void
+json_stats(FILE *f, const char *name, 
+	const struct stats *s, const struct hist *h)
+{
+	size_t	 i;
+
+	fprintf(f, "\"%s\": {\"samples\": %zu, \"mean\": %.9g, "
+		"\"stddev\": %.9g", name, s->n, s->mean, stddev(s));
+	if (NULL != h) {
+		for (i = 0; i < QUANTS; i++)
+			fprintf(f, ", \"%s\": %.9g", quantnames[i], 
+				hist_quant(h, quants[i]));
+		fprintf(f, ", \"max\": %.9g", h->max / 1.0e6);
+	}
+	fputc('}', f);
+}
+
+/*
+ * Write all of our statistics as a JSON document to "f" for comparison
+ * between runs.
+ * Sizes are in bytes and times in seconds.
+ * Returns zero on failure.
+ */
+static int
+game_json(FILE *f, const struct game *g, size_t urlsz)
+{
+	size_t	 i;
+
+	fputs("{\"rounds\": [", f);
+	for (i = 0; i < g->roundsz; i++) {
+		fprintf(f, "%s\n  {\"round\": %zu, \"stamp\": %lld, "
+			"\"plays\": %zu, \"firstplays\": %zu, "
+			"\"lastplays\": %zu, ", i > 0 ? "," : "", i,
+			(long long)g->rounds[i].stamp, 
+			g->rounds[i].plays, g->rounds[i].firstplays, 
+			g->rounds[i].lastplays);
+		json_stats(f, "rx", &g->rounds[i].rx, NULL);
+		fputs(", ", f);
+		json_stats(f, "rtt", &g->rounds[i].rtt, &g->rounds[i].lat);
+		fputc('}', f);
+	}
+	fputs("],\n \"pages\": [", f);
+	for (i = 0; i < PHASE__MAX; i++) {
+		fprintf(f, "%s\n  {\"page\": \"%s\", ", 
+			i > 0 ? "," : "", urls[i] + urlsz + 1);
+		json_stats(f, "rx", &g->page_rx[i], NULL);
+		fputs(", ", f);
+		json_stats(f, "rtt", &g->page_rtt[i], &g->page_lat[i]);
+		fputc('}', f);
+	}
+	fputs("],\n \"total\": {", f);
+	json_stats(f, "rx", &g->total_rx, NULL);
+	fputs(", ", f);
+	json_stats(f, "rtt", &g->total_rtt, &g->total_lat);
+	fprintf(f, "},\n \"abandoned\": %zu}\n", g->abandoned);
+
+	if (ferror(f)) {
+		perror("game_json");
+		return(0);
+	}
+	return(1);
+}
+
+/*
+ * Parse a non-negative number that must make up all of "cp".
+ * Returns zero on failure.
+ */
+static int
+profile_num(const char *cp, double *v)
+{
+	char	*ep;
+
+	*v = strtod(cp, &ep);
+	return(ep != cp && '\0' == *ep && 
+		isfinite(*v) && *v >= 0.0);
+}
+
+/*
+ * Read the traffic profile from "file" into "p", overriding what's
+ * already there.
+ * Each line is a keyword and its arguments, with comments (from `#')
+ * and blank lines being ignored:
+ *
+ *   wait|poll|think fixed|exp secs
+ *   wait|poll|think uniform|normal|lognormal secs secs
+ *   arrive secs percent
+ *   abandon percent
+ *   late percent secs
+ *
+ * Returns zero on failure.
+ */
+static int
+profile_parse(struct profile *p, const char *file)
+{
+	FILE		*f;
+	char		*line, *cp, *tok, *w[4];
+	size_t		 linesz, ln, n, i, j, first, arrives;
+	ssize_t		 len;
+	double		 v[3];
+	const char	*er;
+	struct dist	*d;
+	enum disttype	 dt;
+
+	if (NULL == (f = fopen(file, "r"))) {
+		perror(file);
+		return(0);
+	}
+
+	line = NULL;
+	linesz = ln = arrives = 0;
+	er = NULL;
+
+	while (-1 != (len = getline(&line, &linesz, f))) {
+		ln++;
+		if (len > 0 && '\n' == line[len - 1])
+			line[len - 1] = '\0';
+		if (NULL != (cp = strchr(line, '#')))
+			*cp = '\0';
+
+		/* Split into at most four words. */
+		for (n = 0, cp = line; NULL != (tok = strsep(&cp, " \t")); ) {
+			if ('\0' == *tok)
+				continue;
+			if (4 == n) {
+				er = "too many arguments";
+				break;
+			}
+			w[n++] = tok;
+		}
+		if (NULL != er)
+			break;
+		if (0 == n)
+			continue;
+
+		/* 
+		 * Delays are followed by a distribution name.
+		 * Then all arguments are numbers, with "n" left as their
+		 * count.
+		 */
+		for (i = 0; i < DELAY__MAX; i++)
+			if (0 == strcmp(w[0], delaynames[i]))
+				break;
+		first = i < DELAY__MAX ? 2 : 1;
+		if (n < first) {
+			er = "missing distribution";
+			break;
+		}
+		for (j = first; j < n; j++)
+			if ( ! profile_num(w[j], &v[j - first])) {
+				er = "bad number";
+				break;
+			}
+		if (NULL != er)
+			break;
+		n -= first;
+
+		if (i < DELAY__MAX) {
+			d = &p->delays[i];
+			for (dt = DIST_NONE + 1; dt < DIST__MAX; dt++)
+				if (0 == strcmp(w[1], distnames[dt]))
+					break;
+			if (DIST__MAX == dt) {
+				er = "unknown distribution";
+				break;
+			} else if (n != (DIST_FIXED == dt || 
+			           DIST_EXP == dt ? 1 : 2)) {
+				er = "wrong number of arguments";
+				break;
+			} else if (DIST_UNIFORM == dt && v[0] > v[1]) {
+				er = "minimum exceeds maximum";
+				break;
+			}
+			d->type = dt;
+			d->a = v[0];
+			d->b = 2 == n ? v[1] : 0.0;
+		} else if (0 == strcmp(w[0], "arrive")) {
+			if (2 != n) {
+				er = "wrong number of arguments";
+				break;
+			}
+			/* The file replaces any existing curve. */
+			if (0 == arrives++)
+				p->arrivesz = 0;
+			if (ARRIVE_MAX == p->arrivesz) {
+				er = "too many arrival points";
+				break;
+			} else if (v[1] > 100.0) {
+				er = "percent exceeds 100";
+				break;
+			} else if (p->arrivesz > 0 && 
+			    (v[0] < p->arrive[p->arrivesz - 1] ||
+			     v[1] < p->arrivepct[p->arrivesz - 1])) {
+				er = "arrivals must not decrease";
+				break;
+			}
+			p->arrive[p->arrivesz] = v[0];
+			p->arrivepct[p->arrivesz++] = v[1];
+		} else if (0 == strcmp(w[0], "abandon")) {
+			if (1 != n) {
+				er = "wrong number of arguments";
+				break;
+			} else if (v[0] > 100.0) {
+				er = "percent exceeds 100";
+				break;
+			}
+			p->abandon = v[0];
+		} else if (0 == strcmp(w[0], "late")) {
+			if (2 != n) {
+				er = "wrong number of arguments";
+				break;
+			} else if (v[0] > 100.0) {
+				er = "percent exceeds 100";
+				break;
+			}
+			p->late = v[0];
+			p->latewin = v[1];
+		} else {
+			er = "unknown keyword";
+			break;
+		}
+	}
+
+	if (NULL == er && ferror(f)) {
+		perror(file);
+		free(line);
+		fclose(f);
+		return(0);
+	} else if (NULL == er && p->arrivesz > 0 && 
+	    0.0 == p->arrivepct[p->arrivesz - 1]) {
+		ln = 0;
+		er = "nobody arrives";
+	}
+
+	free(line);
+	fclose(f);
+	if (NULL != er && ln > 0) {
+		fprintf(stderr, "%s:%zu: %s\n", file, ln, er);
+		return(0);
+	} else if (NULL != er) {
+		fprintf(stderr, "%s: %s\n", file, er);
+		return(0);
+	}
+	return(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int	 	 c, rc;
+	size_t		 i, sz;
+	char	 	*url, *field;
+	size_t		 urlsz, jobs;
+	struct game	 game;
+	struct rlimit	 rl;
+	struct dist	*d;
+	const char	*outfile;
+	FILE		*out;
+
+	rc = 0;
+	jobs = 1;
+	outfile = NULL;
+	out = NULL;
+	memset(&game, 0, sizeof(struct game));
+	game.players = 2;
+
+	while (-1 != (c = getopt(argc, argv, "cefj:rn:o:p:vw:W:"))) 
+		switch (c) {
+		case ('c'):
+			game.compress = 1;
+			break;
+		case ('e'):
+			game.equal = 1;
+			break;
+		case ('f'):
+			game.fixunit = 1;
+			break;
+		case ('j'):
+			if ((c = atoi(optarg)) < 1)
+				goto usage;
+			jobs = c;
+			break;
+		case ('r'):
+			game.random = 1;
+			break;
+		case ('n'):
+			game.players = atoi(optarg);
+			break;
+		case ('o'):
+			outfile = optarg;
+			break;
+		case ('p'):
+			if ( ! profile_parse(&game.prof, optarg))
+				return(EXIT_FAILURE);
+			break;
+		case ('v'):
+			game.verbose++;
+			break;
+		case ('w'):
+			d = &game.prof.delays[DELAY_WAIT];
+			if (NULL != (field = strchr(optarg, ':'))) {
+				*field++ = '\0';
+				d->type = DIST_UNIFORM;
+				d->a = atoi(optarg);
+				d->b = atoi(field);
+				if (d->a < 0 || d->a >= d->b)
+					goto usage;
+			} else {
+				d->type = DIST_FIXED;
+				d->a = atoi(optarg);
+				if (d->a < 0) 
+					goto usage;
+			}
+			break;
+		case ('W'):
+			/* Arrivals evenly spread over the interval. */
+			game.prof.arrive[0] = 0.0;
+			game.prof.arrivepct[0] = 0.0;
+			game.prof.arrive[1] = atoi(optarg);
+			game.prof.arrivepct[1] = 100.0;
+			game.prof.arrivesz = 2;
+			break;
+		default:
+			goto usage;
+		}
+
+	if (game.players < 2) {
+		fputs("-n: need a value >2\n", stderr);
+		goto usage;
+	} else if (jobs > game.players) {
+		fputs("-j: more workers than players\n", stderr);
+		goto usage;
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (0 == argc)
+		goto usage;
+
+	url = *argv++;
+	argc--;
+
+	if (0 == (sz = strlen(url))) {
+		fputs("zero-length url\n", stderr);
+		goto usage;
+	} else if ('/' == url[sz - 1])
+		url[sz - 1] = '\0';
+
+	urlsz = strlen(url);
+
+	/*
+	 * Create the URLs used for each phase of the simulation.
+	 * These are created from the base URL.
+	 */
+	c = asprintf(&urls[PHASE_REGISTER], "%s/doautoadd.json", url);
+	if (c < 0) {
+		perror(NULL);
+		return(EXIT_FAILURE);
+	}
+	c = asprintf(&urls[PHASE_LOGIN], "%s/dologin.json", url);
+	if (c < 0) {
+		perror(NULL);
+		free(urls[PHASE_REGISTER]);
+		return(EXIT_FAILURE);
+	}
+	c = asprintf(&urls[PHASE_LOADEXPR], "%s/doloadexpr.json", url);
+	if (c < 0) {
+		perror(NULL);
+		free(urls[PHASE_REGISTER]);
+		free(urls[PHASE_LOGIN]);
+		return(EXIT_FAILURE);
+	}
+	c = asprintf(&urls[PHASE_PLAY], "%s/doplayall.json", url);
+	if (c < 0) {
+		perror(NULL);
+		free(urls[PHASE_REGISTER]);
+		free(urls[PHASE_LOGIN]);
+		free(urls[PHASE_LOADEXPR]);
+		return(EXIT_FAILURE);
+	}
+
+	/* Open this now so as not to lose a long run. */
+	if (NULL != outfile && NULL == (out = fopen(outfile, "w"))) {
+		perror(outfile);
+		goto out;
+	}
+
+	/*
+	 * Each gamer holds open a connection, so make sure we're able
+	 * to open as many descriptors as we're allowed.
+	 * Workers inherit this limit.
+	 */
+	if (0 == getrlimit(RLIMIT_NOFILE, &rl)) {
+		if (rl.rlim_cur < rl.rlim_max) {
+			rl.rlim_cur = rl.rlim_max;
+			if (-1 == setrlimit(RLIMIT_NOFILE, &rl))
+				getrlimit(RLIMIT_NOFILE, &rl);
+		}
+		if (rl.rlim_cur < game.players / jobs + 16)
+			fprintf(stderr, "warning: only %llu "
+				"descriptors for %zu players\n", 
+				(unsigned long long)rl.rlim_cur, 
+				game.players / jobs + 1);
+	}
+
+	if (1 == jobs && ! game_play(&game, 0)) {
+		fputs("game_play\n", stderr);
+		goto out;
+	} else if (jobs > 1 && ! game_fork(&game, jobs)) {
+		fputs("game_fork\n", stderr);
+		goto out;
+	}
 
 	if ( ! game.fixunit) {
 		puts("");
@@ -1852,37 +2981,62 @@ main(int argc, char *argv[])
 		putchar('\n');
 	}
 
+	if ( ! game.fixunit) {
+		puts("");
+		puts("Per-round Latency");
+	}
+	hist_header(&game, "round", 7);
+
+	for (i = 0; i < game.roundsz; i++) {
+		printf("%7zd ", i);
+		hist_print(&game, &game.rounds[i].lat);
+	}
+
+	if ( ! game.fixunit) {
+		puts("");
+		puts("Per-page Latency");
+	}
+	hist_header(&game, "page", 18);
+
+	for (i = 0; i < PHASE__MAX; i++) {
+		printf("%18s ", urls[i] + urlsz + 1);
+		hist_print(&game, &game.page_lat[i]);
+	}
+
+	if ( ! game.fixunit) {
+		puts("");
+		puts("Total Latency");
+		hist_header(&game, "", 11);
+		printf("%11s ", "");
+		hist_print(&game, &game.total_lat);
+	}
+
+	if (game.verbose && game.abandoned)
+		fprintf(stderr, "%zu players abandoned.\n", 
+			game.abandoned);
+
+	if (NULL != out && ! game_json(out, &game, urlsz)) {
+		fputs("game_json\n", stderr);
+		goto out;
+	}
+
 	rc = 1;
 out:
-	/* Memory cleanups and exiting. */
-	for (i = 0; i < game.players; i++) {
-		if (NULL != ctx[i].conn) {
-			curl_multi_remove_handle(game.curl, ctx[i].conn);
-			curl_easy_cleanup(ctx[i].conn);
-		}
-		free(ctx[i].games);
-		free(ctx[i].email);
-		free(ctx[i].password);
-		free(ctx[i].sessid);
-		free(ctx[i].sesscookie);
-		free(ctx[i].post.b);
-		free(ctx[i].cookie.b);
-		json_tokener_free(ctx[i].tok);
-		if (NULL != ctx[i].parsed)
-			json_object_put(ctx[i].parsed);
+	if (NULL != out && EOF == fclose(out)) {
+		perror(outfile);
+		rc = 0;
 	}
-
 	for (i = 0; i < PHASE__MAX; i++)
 		free(urls[i]);
-
-	free(ctx);
-	curl_multi_cleanup(game.curl);
-	curl_global_cleanup();
+	free(game.rounds);
 	return(rc ? EXIT_SUCCESS : EXIT_FAILURE);
 usage:
 	fprintf(stderr, "usage: %s "
 		"[-cefrv] "
+		"[-j workers] "
 		"[-n players] "
+		"[-o file] "
+		"[-p profile] "
 		"[-w [time|min:max]] "
 		"[-W max] "
 		"url\n", getprogname());
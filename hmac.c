@@ -22,19 +22,14 @@
 #include "extern.h"
 
 /*
-   unsigned char*  text;                pointer to data stream
-   int             text_len;            length of data stream
-   unsigned char*  key;                 pointer to authentication key
-   int             key_len;             length of authentication key
-   unsigned char*  digest;              caller digest to be filled in
-   */
-
+ * Precompute the inner and outer hash states of HMAC-SHA1 for "key" of
+ * "key_len" bytes, so that each message signed with hmac_sha1_ctx()
+ * costs only the message hash and one outer block.
+ */
 void
-hmac_sha1(const unsigned char *text, int text_len,
-		const unsigned char *key, int key_len,
-		unsigned char *digest)
+hmac_sha1_init(HMAC_SHA1_CTX *ctx,
+		const unsigned char *key, int key_len)
 {
-	SHA1_CTX context;
 	unsigned char k_ipad[65];    /* inner padding -
 				      * key XORd with ipad
 				      */
@@ -79,25 +74,60 @@ hmac_sha1(const unsigned char *text, int text_len,
 		k_ipad[i] ^= 0x36;
 		k_opad[i] ^= 0x5c;
 	}
+
+	/* hash the pads once: these are the per-key states */
+	SHA1Init(&ctx->inner);
+	SHA1Update(&ctx->inner, k_ipad, 64);
+	SHA1Init(&ctx->outer);
+	SHA1Update(&ctx->outer, k_opad, 64);
+}
+
+/*
+ * Compute the HMAC-SHA1 "digest" of "text" with the key precomputed in
+ * "ctx" by hmac_sha1_init().
+ * The context is copied, not modified, so it may be re-used.
+ */
+void
+hmac_sha1_ctx(const HMAC_SHA1_CTX *ctx,
+		const unsigned char *text, int text_len,
+		unsigned char *digest)
+{
+	SHA1_CTX context;
+
 	/*
 	 * perform inner SHA1
 	 */
-	SHA1Init(&context);                   /* init context for 1st
-					       * pass */
-	SHA1Update(&context, k_ipad, 64);      /* start with inner pad */
+	context = ctx->inner;                 /* resume after inner pad */
 	SHA1Update(&context, text, text_len); /* then text of datagram */
 	SHA1Final(digest, &context);          /* finish up 1st pass */
 	/*
-	 * perform outer MD5
+	 * perform outer SHA1
 	 */
-	SHA1Init(&context);                   /* init context for 2nd
-					       * pass */
-	SHA1Update(&context, k_opad, 64);     /* start with outer pad */
+	context = ctx->outer;                 /* resume after outer pad */
 	SHA1Update(&context, digest, 20);     /* then results of 1st
 					       * hash */
 	SHA1Final(digest, &context);          /* finish up 2nd pass */
 }
 
+/*
+   unsigned char*  text;                pointer to data stream
+   int             text_len;            length of data stream
+   unsigned char*  key;                 pointer to authentication key
+   int             key_len;             length of authentication key
+   unsigned char*  digest;              caller digest to be filled in
+   */
+
+void
+hmac_sha1(const unsigned char *text, int text_len,
+		const unsigned char *key, int key_len,
+		unsigned char *digest)
+{
+	HMAC_SHA1_CTX ctx;
+
+	hmac_sha1_init(&ctx, key, key_len);
+	hmac_sha1_ctx(&ctx, text, text_len, digest);
+}
+
 /*
    Test Vectors (Trailing '\0' of a character string not included in test):
 
@@ -120,39 +150,78 @@ hmac_sha1(const unsigned char *text, int text_len,
 
 #ifdef TESTING
 /*
- *  cc -DTESTING -I ../include/ hmac.c md5.c -o hmac
+ *  cc -DTESTING ... hmac.c sha1.c -o hmac
+ *
+ *  ./hmac Jefe "what do ya want for nothing?" [iterations]
  *
- *  ./hmac Jefe "what do ya want for nothing?"
+ *  With iterations, also time signing that many times with and without
+ *  a precomputed key.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return(ts.tv_sec + ts.tv_nsec / 1.0e9);
+}
 
 int main(int argc, char **argv)
 {
 	unsigned char digest[20];
+	HMAC_SHA1_CTX ctx;
 	char *key;
 	int key_len;
 	char *text;
 	int text_len;
+	long iters, j;
+	double start, plain, precomp;
 	int i;
 
+	if (argc < 3)
+		return(1);
+
 	key = argv[1];
 	key_len = strlen(key);
 
 	text = argv[2];
 	text_len = strlen(text);
 
-	lrad_hmac_sha1(text, text_len, key, key_len, digest);
+	hmac_sha1((unsigned char *)text, text_len,
+		(unsigned char *)key, key_len, digest);
 
 	for (i = 0; i < 20; i++) {
 		printf("%02x", digest[i]);
 	}
 	printf("\n");
 
-	exit(0);
-	return 0;
+	if (argc < 4)
+		return(0);
+	iters = atol(argv[3]);
+
+	start = now();
+	for (j = 0; j < iters; j++)
+		hmac_sha1((unsigned char *)text, text_len,
+			(unsigned char *)key, key_len, digest);
+	plain = now() - start;
+
+	start = now();
+	hmac_sha1_init(&ctx, (unsigned char *)key, key_len);
+	for (j = 0; j < iters; j++)
+		hmac_sha1_ctx(&ctx, (unsigned char *)text, 
+			text_len, digest);
+	precomp = now() - start;
+
+	printf("hmac_sha1:     %.3f s, %.3f us/message\n", 
+		plain, plain * 1.0e6 / iters);
+	printf("hmac_sha1_ctx: %.3f s, %.3f us/message\n", 
+		precomp, precomp * 1.0e6 / iters);
+	return(0);
 }
 
 #endif
-
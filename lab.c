@@ -75,6 +75,7 @@ enum	page {
 	PAGE_DOLOGIN,
 	PAGE_DOLOGOUT,
 	PAGE_DOPLAY,
+	PAGE_DOPLAYALL,
 	PAGE_INDEX,
 	PAGE_MTURK,
 	PAGE_MTURKFINISH,
@@ -130,6 +131,7 @@ static	unsigned int perms[PAGE__MAX] = {
 	PERM_JSON | PERM_HTML, /* PAGE_DOLOGIN */
 	PERM_HTML | PERM_LOGIN, /* PAGE_DOLOGOUT */
 	PERM_JSON | PERM_LOGIN, /* PAGE_DOPLAY */
+	PERM_JSON | PERM_LOGIN, /* PAGE_DOPLAYALL */
 	PERM_HTML | PERM_LOGIN, /* PAGE_INDEX */
 	PERM_HTML, /* PAGE_MTURK */
 	PERM_JSON | PERM_LOGIN, /* PAGE_MTURKFINISH */
@@ -146,6 +148,7 @@ static const char *const pages[PAGE__MAX] = {
 	"dologin", /* PAGE_DOLOGIN */
 	"dologout", /* PAGE_DOLOGOUT */
 	"doplay", /* PAGE_DOPLAY */
+	"doplayall", /* PAGE_DOPLAYALL */
 	"index", /* PAGE_INDEX */
 	"mturk", /* PAGE_MTURK */
 	"mturkfinish", /* PAGE_MTURKFINISH */
@@ -991,6 +994,7 @@ senddoloadexpr(struct kreq *r, int64_t playerid)
 	char		 buf[22];
 	const char	*cp;
 
+	metrics_add(METRIC_LOADS, 1);
 again:
 	/* All response have at least the following. */
 	if (NULL == (expr = db_expr_get(1))) {
@@ -1038,6 +1042,7 @@ again:
 			khttp_head(r, kresps[KRESP_STATUS], 
 				"%s", khttps[KHTTP_304]);
 			khttp_body(r);
+			metrics_add(METRIC_NOTMOD, 1);
 			db_expr_free(expr);
 			db_player_free(player);
 			return;
@@ -1206,14 +1211,18 @@ senddoplay(struct kreq *r, int64_t playerid)
 {
 	struct player	 *player;
 	struct game	 *game;
-	size_t		  i, j, strats;
-	char		  buf[128];
-	mpq_t		  sum, one;
+	size_t		  i, strats;
+	unsigned long long idx;
+	int		 *seen;
+	const char	 *key;
+	char		 *ep;
+	mpq_t		  sum, one, q;
 	mpq_t		 *mixes;
 
 	player = NULL;
 	game = NULL;
 	mixes = NULL;
+	seen = NULL;
 	strats = 0;
 	mpq_init(one);
 	mpq_init(sum);
@@ -1236,40 +1245,43 @@ senddoplay(struct kreq *r, int64_t playerid)
 
 	/* 
 	 * We'll need this number of strategies.
-	 * Initialise the strategy array right now.
+	 * Initialise the strategy array right now: strategies that we
+	 * don't find, or that are empty, are zero.
 	 */
 	strats = (0 == player->role) ? game->p1 : game->p2;
 	mixes = kcalloc(strats, sizeof(mpq_t));
+	seen = kcalloc(strats, sizeof(int));
+	for (i = 0; i < strats; i++)
+		mpq_init(mixes[i]);
 
 	/*
-	 * Look up each strategy array in the field array.
-	 * If we don't find it, or it's empty, then pretend that we've
-	 * just entered zero.
-	 * Otherwise, make sure it's a valid number and canonicalise it.
+	 * Make one pass through the field array, picking out the
+	 * "indexNN" fields and slotting them into the strategy array.
+	 * Like kcgi's field map, the first field for a given strategy
+	 * is used and later ones ignored, as are strategies beyond the
+	 * maximum.
+	 * Make sure each is a valid number and canonicalise it.
 	 * If anything goes wrong, punt to KHTTP_400.
 	 */
-	for (i = 0; i < strats; i++) {
-		(void)snprintf(buf, sizeof(buf), "index%zu", i);
-		for (j = 0; j < r->fieldsz; j++)
-			if (0 == strcmp(r->fields[j].key, buf))
-				break;
-
-		if (j == r->fieldsz) {
-			mpq_init(mixes[i]);
+	for (i = 0; i < r->fieldsz; i++) {
+		key = r->fields[i].key;
+		if (strncmp(key, "index", 5) || 
+		    ! isdigit((unsigned char)key[5]) ||
+		    ('0' == key[5] && '\0' != key[6]))
 			continue;
-		} else if ( ! kvalid_stringne(&r->fields[j])) {
-			mpq_init(mixes[i]);
+		idx = strtoull(key + 5, &ep, 10);
+		if ('\0' != *ep || idx >= strats || seen[idx])
 			continue;
-		}
-		
-		if ( ! mpq_str2mpqu(r->fields[j].val, mixes[i])) {
+		seen[idx] = 1;
+		if ( ! kvalid_stringne(&r->fields[i]))
+			continue;
+		if ( ! mpq_str2mpqu(r->fields[i].val, q)) {
 			http_open(r, KHTTP_400);
-			for ( ; i < strats; i++)
-				mpq_init(mixes[i]);
 			goto out;
 		}
-
-		mpq_summation(sum, mixes[i]);
+		mpq_set(mixes[idx], q);
+		mpq_clear(q);
+		mpq_summation(sum, mixes[idx]);
 	}
 
 	mpq_set_ui(one, 1, 1);
@@ -1311,12 +1323,166 @@ out:
 		for (i = 0; i < strats; i++)
 			mpq_clear(mixes[i]);
 	free(mixes);
+	free(seen);
 	mpq_clear(one);
 	mpq_clear(sum);
 	db_player_free(player);
 	db_game_free(game);
 }
 
+static int
+gamecmp(const void *key, const void *elem)
+{
+	int64_t	 id = *(const int64_t *)key;
+
+	if (id < ((const struct game *)elem)->id)
+		return(-1);
+	return(id > ((const struct game *)elem)->id);
+}
+
+/*
+ * Play all remaining games of a round in one request.
+ * Each game is given as a field "mixNN", where NN is the game
+ * identifier, whose value is the white-space separated mixture of
+ * strategies (missing trailing strategies are zero).
+ * All choices are recorded in one transaction: if any of them fails,
+ * none of them are recorded.
+ */
+static void
+senddoplayall(struct kreq *r, int64_t playerid)
+{
+	struct player	 *player;
+	struct game	 *games, *game;
+	struct mixture	 *mixes, *mix;
+	size_t		  i, j, gamesz, mixsz;
+	int64_t		  gameid;
+	const char	 *key;
+	char		 *buf, *sv, *tok, *ep;
+	mpq_t		  sum, one, q;
+
+	player = NULL;
+	games = NULL;
+	mixes = NULL;
+	gamesz = mixsz = 0;
+	mpq_init(one);
+	mpq_init(sum);
+	mpq_set_ui(one, 1, 1);
+	mpq_canonicalize(one);
+
+	if (kpairbad(r, KEY_ROUND)) {
+		http_open(r, KHTTP_400);
+		goto out;
+	}
+
+	player = db_player_load(playerid);
+	assert(NULL != player);
+
+	/* 
+	 * Games are ordered by identifier, so we can look them up with
+	 * a binary search as we make one pass through the fields.
+	 * Mixtures are indexed by game position.
+	 */
+	games = db_game_load_all_array(&gamesz);
+	mixes = kcalloc(gamesz, sizeof(struct mixture));
+
+	for (i = 0; i < r->fieldsz; i++) {
+		key = r->fields[i].key;
+		if (strncmp(key, "mix", 3))
+			continue;
+		gameid = strtoll(key + 3, &ep, 10);
+		if ('\0' == key[3] || '\0' != *ep) {
+			http_open(r, KHTTP_400);
+			goto out;
+		}
+		game = bsearch(&gameid, games, gamesz, 
+			sizeof(struct game), gamecmp);
+		if (NULL == game || 
+		    NULL != mixes[game - games].plays) {
+			http_open(r, KHTTP_400);
+			goto out;
+		}
+
+		mix = &mixes[game - games];
+		mix->gameid = game->id;
+		mix->sz = (0 == player->role) ? game->p1 : game->p2;
+		mix->plays = kcalloc(mix->sz, sizeof(mpq_t));
+		for (j = 0; j < mix->sz; j++)
+			mpq_init(mix->plays[j]);
+
+		/*
+		 * Parse and canonicalise each strategy weight.
+		 * These must be non-negative and sum to one.
+		 */
+		mpq_set_ui(sum, 0, 1);
+		buf = sv = kstrdup(r->fields[i].val);
+		j = 0;
+		while (NULL != (tok = strsep(&buf, " \t\n\r"))) {
+			if ('\0' == *tok)
+				continue;
+			if (j == mix->sz || ! mpq_str2mpqu(tok, q)) {
+				free(sv);
+				http_open(r, KHTTP_400);
+				goto out;
+			}
+			mpq_set(mix->plays[j], q);
+			mpq_clear(q);
+			mpq_summation(sum, mix->plays[j++]);
+		}
+		free(sv);
+
+		if ( ! mpq_equal(one, sum)) {
+			http_open(r, KHTTP_400);
+			goto out;
+		}
+		mixsz++;
+	}
+
+	if (0 == mixsz) {
+		http_open(r, KHTTP_400);
+		goto out;
+	}
+
+	/* Pack the played games to the front of the array. */
+	for (i = j = 0; i < gamesz; i++) {
+		if (NULL == mixes[i].plays)
+			continue;
+		if (i != j) {
+			mixes[j] = mixes[i];
+			memset(&mixes[i], 0, sizeof(struct mixture));
+		}
+		j++;
+	}
+	assert(j == mixsz);
+
+	assert(NULL != r->cookiemap[KEY_SESSID] ||
+	       NULL != r->fieldmap[KEY_SESSID]);
+
+	if (0 == db_player_playall
+		(player, 
+		 NULL != r->cookiemap[KEY_SESSID] ?
+		 r->cookiemap[KEY_SESSID]->parsed.i :
+		 r->fieldmap[KEY_SESSID]->parsed.i,
+		 r->fieldmap[KEY_ROUND]->parsed.i,
+		 mixes, mixsz))
+		http_open(r, KHTTP_409);
+	else
+		http_open(r, KHTTP_200);
+
+out:
+	khttp_body(r);
+	if (NULL != mixes)
+		for (i = 0; i < gamesz; i++) {
+			for (j = 0; j < mixes[i].sz; j++)
+				mpq_clear(mixes[i].plays[j]);
+			free(mixes[i].plays);
+		}
+	free(mixes);
+	mpq_clear(one);
+	mpq_clear(sum);
+	db_player_free(player);
+	db_game_free_array(games, gamesz);
+}
+
 static void
 senddologout(struct kreq *r)
 {
@@ -1420,6 +1586,9 @@ doreq(struct kreq *r)
 	case (PAGE_DOPLAY):
 		senddoplay(r, id);
 		break;
+	case (PAGE_DOPLAYALL):
+		senddoplayall(r, id);
+		break;
 	case (PAGE_MTURK):
 		sendmturk(r);
 		break;
@@ -1464,7 +1633,9 @@ main(void)
 	er = khttp_parse(&r, keys, KEY__MAX, 
 		pages, PAGE__MAX, PAGE_INDEX);
 	if (KCGI_OK == er) {
+		dbg_request(r.pagename);
 		doreq(&r);
+		dbg_request_done();
 		khttp_free(&r);
 	} else 
 		WARNX("khttp_parse: error %d", er);
@@ -30,28 +30,224 @@
 
 #include "extern.h"
 
+/*
+ * Lines are formatted into this buffer and written with a single
+ * write(2), so concurrent processes appending to the log don't
+ * interleave and we don't pay for stdio on every line.
+ * Longer lines are truncated.
+ */
+#define	LOGBUFSZ 4096
+
+/*
+ * dbg_request_done() only logs requests taking at least this many
+ * milliseconds.
+ * Set this to zero to log every request when debugging.
+ */
+#ifndef REQLOG_MS
+#define	REQLOG_MS 250
+#endif
+
+struct	reqstats reqstats;
+
+static	char logbuf[LOGBUFSZ]; /* line being formatted */
+static	size_t logsz; /* length of line */
+static	time_t logtime = -1; /* time of logstamp */
+static	char logstamp[32]; /* formatted logtime */
+static	const char *logpage; /* page being served (or NULL) */
+static	char logreq[32]; /* request identifier */
+static	struct timespec logstart; /* when request started */
+
+/*
+ * Associate subsequent log lines with a request for "page".
+ * This starts the request's latency clock.
+ */
 void
-dbg_info(const char *file, size_t line, const char *fmt, ...)
+dbg_request(const char *page)
+{
+
+	logpage = NULL == page ? "" : page;
+	memset(&reqstats, 0, sizeof(struct reqstats));
+	clock_gettime(CLOCK_MONOTONIC, &logstart);
+	(void)snprintf(logreq, sizeof(logreq), "%lld-%ld", 
+		(long long)time(NULL), (long)getpid());
+}
+
+/*
+ * Log the wall time and reqstats of the request started with
+ * dbg_request(), if it took at least REQLOG_MS, and add them to the
+ * shared metrics.
+ */
+void
+dbg_request_done(void)
+{
+	struct timespec	 now;
+	double		 ms;
+
+	if (NULL == logpage)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (now.tv_sec - logstart.tv_sec) * 1.0e3 +
+		(now.tv_nsec - logstart.tv_nsec) / 1.0e6;
+
+	metrics_add(METRIC_REQUESTS, 1);
+	metrics_add(METRIC_BUSY, reqstats.busy);
+	metrics_time(MHIST_REQUEST, ms / 1.0e3);
+	metrics_time(MHIST_DB, reqstats.steptime);
+	if (ms >= REQLOG_MS)
+		INFO("Request %s: %.3f ms, %zu statements, %zu steps "
+			"(%.3f ms), %zu rows, %zu busy, %zu rationals", 
+			logpage, ms, reqstats.stmts, reqstats.steps, 
+			reqstats.steptime * 1.0e3, reqstats.rows, 
+			reqstats.busy, reqstats.mpqs);
+	logpage = NULL;
+}
+
+/*
+ * Append to the line, truncating (leaving room for the newline).
+ */
+static void
+logvappend(const char *fmt, va_list ap)
+{
+	int	 c;
+
+	if (logsz >= LOGBUFSZ - 1)
+		return;
+	c = vsnprintf(logbuf + logsz, LOGBUFSZ - 1 - logsz, fmt, ap);
+	if (c < 0)
+		return;
+	logsz += (size_t)c < LOGBUFSZ - 1 - logsz ? 
+		(size_t)c : LOGBUFSZ - 2 - logsz;
+}
+
+static void
+logappend(const char *fmt, ...)
 {
 	va_list	 ap;
-#ifdef LOGTIME
-	char	 buf[32];
+
+	va_start(ap, fmt);
+	logvappend(fmt, ap);
+	va_end(ap);
+}
+
+/*
+ * Format the current time once per second.
+ */
+static const char *
+logstamp_get(void)
+{
 	time_t	 t;
-	size_t	 sz;
+
+	if ((t = time(NULL)) == logtime)
+		return(logstamp);
+	logtime = t;
+#ifdef LOGJSON
+	strftime(logstamp, sizeof(logstamp), 
+		"%Y-%m-%dT%H:%M:%SZ", gmtime(&t));
+#else
+	ctime_r(&t, logstamp);
+	logstamp[strlen(logstamp) - 1] = '\0';
 #endif
-#ifdef	LOGTIME
-	t = time(NULL);
-	ctime_r(&t, buf);
-	sz = strlen(buf);
-	buf[sz - 1] = '\0';
-	fprintf(stderr, "[%s] ", buf);
+	return(logstamp);
+}
+
+#ifdef LOGJSON
+/*
+ * Append "s" as (the inside of) a JSON string.
+ */
+static void
+logescape(const char *s)
+{
+
+	for ( ; '\0' != *s && logsz < LOGBUFSZ - 8; s++)
+		switch (*s) {
+		case ('"'):
+		case ('\\'):
+			logbuf[logsz++] = '\\';
+			logbuf[logsz++] = *s;
+			break;
+		case ('\n'):
+			logbuf[logsz++] = '\\';
+			logbuf[logsz++] = 'n';
+			break;
+		default:
+			if ((unsigned char)*s < 0x20)
+				logappend("\\u%.4x", *s);
+			else
+				logbuf[logsz++] = *s;
+			break;
+		}
+}
 #endif
-	fprintf(stderr, "[gamelab-info] %s:%zu: ", file, line);
+
+/*
+ * Format a log line and write it to stderr.
+ * If "er" is non-zero, its error message is appended.
+ */
+static void
+dbg_log(const char *level, const char *file, 
+	size_t line, int er, const char *fmt, va_list ap)
+{
+	size_t		 off;
+	ssize_t		 ssz;
+	int		 saved = errno;
+#ifdef LOGJSON
+	struct timespec	 now;
+	char		 msg[LOGBUFSZ];
+#endif
+
+	logsz = 0;
+#ifdef LOGJSON
+	(void)vsnprintf(msg, sizeof(msg), fmt, ap);
+	logappend("{\"time\":\"%s\",\"level\":\"%s\","
+		"\"file\":\"%s\",\"line\":%zu", 
+		logstamp_get(), level, file, line);
+	if (NULL != logpage) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		logappend(",\"req\":\"%s\",\"page\":\"", logreq);
+		logescape(logpage);
+		logappend("\",\"ms\":%.3f", 
+			(now.tv_sec - logstart.tv_sec) * 1.0e3 +
+			(now.tv_nsec - logstart.tv_nsec) / 1.0e6);
+	}
+	logappend(",\"msg\":\"");
+	logescape(msg);
+	if (0 != er) {
+		logappend(": ");
+		logescape(strerror(er));
+	}
+	logappend("\"}");
+#else
+#ifdef LOGTIME
+	logappend("[%s] ", logstamp_get());
+#endif
+	logappend("[gamelab-%s] %s:%zu: ", level, file, line);
+	logvappend(fmt, ap);
+	if (0 != er)
+		logappend(": %s", strerror(er));
+#endif
+	logbuf[logsz++] = '\n';
+
+	for (off = 0; off < logsz; off += ssz)
+		if (-1 == (ssz = write(STDERR_FILENO, 
+		    logbuf + off, logsz - off))) {
+			if (EINTR == errno) {
+				ssz = 0;
+				continue;
+			}
+			break;
+		}
+
+	errno = saved;
+}
+
+void
+dbg_info(const char *file, size_t line, const char *fmt, ...)
+{
+	va_list	 ap;
+
 	va_start(ap, fmt);
-	vfprintf(stderr, fmt, ap);
+	dbg_log("info", file, line, 0, fmt, ap);
 	va_end(ap);
-	fputc('\n', stderr);
-	fflush(stderr);
 }
 
 void
@@ -59,46 +255,18 @@ dbg_warn(const char *file, size_t line, const char *fmt, ...)
 {
 	va_list	 ap;
 	int	 er = errno;
-#ifdef LOGTIME
-	char	 buf[32];
-	time_t	 t;
-	size_t	 sz;
-#endif
-#ifdef	LOGTIME
-	t = time(NULL);
-	ctime_r(&t, buf);
-	sz = strlen(buf);
-	buf[sz - 1] = '\0';
-	fprintf(stderr, "[%s] ", buf);
-#endif
-	fprintf(stderr, "[gamelab-WARN] %s:%zu: ", file, line);
+
 	va_start(ap, fmt);
-	vfprintf(stderr, fmt, ap);
+	dbg_log("WARN", file, line, er, fmt, ap);
 	va_end(ap);
-	fprintf(stderr, ": %s\n", strerror(er));
-	fflush(stderr);
 }
 
 void
 dbg_warnx(const char *file, size_t line, const char *fmt, ...)
 {
 	va_list	 ap;
-#ifdef LOGTIME
-	char	 buf[32];
-	time_t	 t;
-	size_t	 sz;
-#endif
-#ifdef	LOGTIME
-	t = time(NULL);
-	ctime_r(&t, buf);
-	sz = strlen(buf);
-	buf[sz - 1] = '\0';
-	fprintf(stderr, "[%s] ", buf);
-#endif
-	fprintf(stderr, "[gamelab-WARN] %s:%zu: ", file, line);
+
 	va_start(ap, fmt);
-	vfprintf(stderr, fmt, ap);
+	dbg_log("WARN", file, line, 0, fmt, ap);
 	va_end(ap);
-	fputc('\n', stderr);
-	fflush(stderr);
 }
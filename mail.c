@@ -14,10 +14,12 @@
  * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
+#include <sys/file.h>
 #include <sys/stat.h>
 
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <stdarg.h>
@@ -34,6 +36,19 @@
 
 #include "extern.h"
 
+#ifndef MAIL_POOL
+# define MAIL_POOL	 8 /* concurrent SMTP transfers */
+#endif
+#ifndef MAIL_CHUNK
+# define MAIL_CHUNK	 50 /* recipients per message */
+#endif
+#define	MAIL_BATCH	 128 /* players loaded per batch */
+#define	MAIL_TRIES	 3 /* attempts per message */
+#define	MAILQ_TRIES	 6 /* attempts per queued job */
+#define	MAILQ_BACKOFF	 60 /* first retry (seconds), doubling */
+#define	MAILQ_POLL	 10 /* max seconds between queue checks */
+#define	MAILQ_LOCK	 DATADIR "/mailq.lock"
+
 /*
  * This is the buffer created when templating a mail message.
  * We use it to read in and write out the buffer, hence having both "sz"
@@ -67,6 +82,40 @@ struct	mail {
 	int64_t		 minminutes; /* round time in minutes */
 };
 
+/*
+ * One of a pool of concurrent transfers.
+ * Each has its own CURL handle (duplicated from the one configured by
+ * mail_init()) and message buffer.
+ */
+struct	mailslot {
+	CURL		  *curl; /* transfer handle */
+	struct curl_slist *recpts; /* recipients (or NULL) */
+	struct buf	   b; /* rendered message */
+	void		  *arg; /* job or NULL if idle */
+};
+
+/*
+ * A range of recipients in a "struct mailrcpts" to be sent one message
+ * by mail_roundadvance().
+ */
+struct	mailchunk {
+	size_t		 first; /* first recipient */
+	size_t		 sz; /* number of recipients */
+	size_t		 tries; /* attempts made */
+	int		 busy; /* being sent */
+	int		 done; /* sent or given up */
+	int		 failed; /* given up */
+};
+
+/*
+ * Recipient addresses as collected by mail_appendplayer().
+ */
+struct	mailrcpts {
+	char		**mails; /* addresses */
+	size_t		  sz; /* number of addresses */
+	size_t		  max; /* allocated addresses */
+};
+
 enum	mailkey {
 	MAILKEY_FROM, /* "from" address */
 	MAILKEY_TO, /* "to" address */
@@ -170,23 +219,6 @@ mail_free(struct mail *mail, CURL *c, struct curl_slist *r)
 	curl_global_cleanup();
 }
 
-/*
- * Clear the mail context for the next invocation.
- * This should only clear the necessary bits.
- */
-static void
-mail_clear(struct mail *mail, struct curl_slist **rp)
-{
-
-	free(mail->to);
-	free(mail->pass);
-	free(mail->login);
-	mail->b.sz = mail->b.cur = 0;
-	mail->to = mail->pass = mail->login = NULL;
-	curl_slist_free_all(*rp);
-	*rp = NULL;
-}
-
 /*
  * String wrapper for mail_write().
  */
@@ -323,67 +355,249 @@ mail_init(struct mail *mail, struct ktemplate *t)
 	return(curl);
 }
 
-void 
+static void
+mailpool_free(CURLM *multi, struct mailslot *slots, size_t sz)
+{
+	size_t	 i;
+
+	for (i = 0; i < sz; i++) {
+		if (NULL != slots[i].arg)
+			curl_multi_remove_handle(multi, slots[i].curl);
+		free(slots[i].b.buf);
+		curl_slist_free_all(slots[i].recpts);
+		if (NULL != slots[i].curl)
+			curl_easy_cleanup(slots[i].curl);
+	}
+	curl_multi_cleanup(multi);
+}
+
+/*
+ * Create a pool of "sz" transfers, each duplicated from "curl" (as
+ * configured by mail_init()), sharing a multi handle that allows no
+ * more connections than transfers.
+ * Connections are kept open and re-used between transfers.
+ * Returns NULL on failure, having freed any resources.
+ */
+static CURLM *
+mailpool_init(CURL *curl, struct mailslot *slots, size_t sz)
+{
+	CURLM	*multi;
+	size_t	 i;
+
+	memset(slots, 0, sz * sizeof(struct mailslot));
+
+	if (NULL == (multi = curl_multi_init())) {
+		WARNX("curl_multi_init");
+		return(NULL);
+	}
+	curl_multi_setopt(multi, 
+		CURLMOPT_MAX_TOTAL_CONNECTIONS, (long)sz);
+
+	for (i = 0; i < sz; i++) {
+		if (NULL == (slots[i].curl = curl_easy_duphandle(curl))) {
+			WARNX("curl_easy_duphandle");
+			mailpool_free(multi, slots, sz);
+			return(NULL);
+		}
+		curl_easy_setopt(slots[i].curl, 
+			CURLOPT_READDATA, &slots[i].b);
+		curl_easy_setopt(slots[i].curl, 
+			CURLOPT_PRIVATE, &slots[i]);
+	}
+
+	return(multi);
+}
+
+/*
+ * Start sending the message in the idle slot "s" to its recipients,
+ * marking it as busy with "arg".
+ */
+static void
+mailpool_start(CURLM *multi, struct mailslot *s, void *arg)
+{
+
+	assert(NULL == s->arg && NULL != arg);
+	s->b.cur = 0;
+	curl_easy_setopt(s->curl, CURLOPT_MAIL_RCPT, s->recpts);
+	curl_multi_add_handle(multi, s->curl);
+	s->arg = arg;
+}
+
+/*
+ * Drive all transfers, blocking for at most a second if "block" is set.
+ * Returns the next finished slot (its result in "res") or NULL if none
+ * have finished.
+ * Finished slots have their recipients freed but retain their message
+ * and "arg": the caller must set the latter to NULL before re-use.
+ */
+static struct mailslot *
+mailpool_reap(CURLM *multi, int block, CURLcode *res)
+{
+	CURLMsg		*msg;
+	struct mailslot	*s;
+	int		 running, fds, msgs;
+
+	if (block)
+		curl_multi_wait(multi, NULL, 0, 1000, &fds);
+	curl_multi_perform(multi, &running);
+
+	while (NULL != (msg = curl_multi_info_read(multi, &msgs))) {
+		if (CURLMSG_DONE != msg->msg)
+			continue;
+		*res = msg->data.result;
+		curl_easy_getinfo(msg->easy_handle, 
+			CURLINFO_PRIVATE, (char **)&s);
+		curl_multi_remove_handle(multi, s->curl);
+		curl_slist_free_all(s->recpts);
+		s->recpts = NULL;
+		return(s);
+	}
+
+	return(NULL);
+}
+
+/*
+ * Template the invitation for "np" into the shared buffer, then hand
+ * the result over to the idle slot "s" (recycling the slot's previous
+ * buffer as the new shared one).
+ * This way the next message can be rendered while others are in flight.
+ * Returns zero on templating failure.
+ */
+static int
+mail_player_start(struct mail *m, struct ktemplate *t,
+	struct ktemplatex *tx, const char *loginuri,
+	struct mailslot *s, struct newplayer *np)
+{
+	char		*encto, *encpass;
+	struct buf	 tmp;
+	enum kcgi_err	 rc;
+
+	encto = kutil_urlencode(np->mail);
+	encpass = kutil_urlencode(np->pass);
+	kasprintf(&m->login, "%s?ident=%s&password=%s", 
+		loginuri, encto, encpass);
+	free(encto);
+	free(encpass);
+
+	/* These are owned by "np": don't let mail_free() see them. */
+	m->to = np->mail;
+	m->pass = np->pass;
+	m->b.sz = m->b.cur = 0;
+
+	rc = khttp_templatex(t, DATADIR 
+		"/mail-addplayer.eml", tx, m);
+
+	free(m->login);
+	m->to = m->pass = m->login = NULL;
+
+	if (KCGI_OK != rc) {
+		WARNX("khttp_templatex: %s", kcgi_strerror(rc));
+		return(0);
+	}
+
+	tmp = s->b;
+	s->b = m->b;
+	m->b = tmp;
+	s->recpts = curl_slist_append(NULL, np->mail);
+	return(1);
+}
+
+/*
+ * Mail out passwords to all new players.
+ * Players are loaded in batches of MAIL_BATCH and sent over a pool of
+ * MAIL_POOL concurrent transfers, each batch's results being written
+ * back in a single transaction.
+ * If we have no SMTP configured, players are simply marked as mailed.
+ * Returns zero if any player could not be mailed or we stopped early,
+ * so that the job is retried.
+ */
+static int
 mail_players(const char *uri, const char *loginuri)
 {
 	CURL		  *curl;
-	CURLcode 	   res;
-	struct curl_slist *recpts = NULL;
+	CURLM		  *multi;
+	CURLcode	   res;
+	struct mailslot	   slots[MAIL_POOL], *s;
+	struct newplayer   np[MAIL_BATCH], *p;
 	struct mail	   m;
-	int64_t		   id;
-	char		  *encto, *encpass;
 	struct ktemplate   t;
 	struct ktemplatex  tx;
-	enum kcgi_err	   rc;
+	size_t		   i, sz, next, active, errors = 0;
+	int64_t		   last = 0;
+	int		   fail = 0;
 
 	memset(&tx, 0, sizeof(struct ktemplatex));
 	tx.writer = mail_write;
 
-	curl = mail_init(&m, &t);
 	/* Can be NULL: we want to set the statuses. */
-	m.uri = uri;
-
-	while (NULL != (m.to = db_player_next_new(&id, &m.pass))) {
-		if (NULL == curl) {
-			db_player_set_mailed(id, m.pass);
-			free(m.to);
-			free(m.pass);
-			continue;
-		}
-
-		assert(NULL != m.pass);
-		encto = kutil_urlencode(m.to);
-		encpass = kutil_urlencode(m.pass);
-		kasprintf(&m.login, "%s?ident=%s&password=%s", 
-			loginuri, encto, encpass);
-		free(encto);
-		free(encpass);
-
-		rc = khttp_templatex(&t, DATADIR 
-			"/mail-addplayer.eml", &tx, &m);
-		if (KCGI_OK != rc) {
-			WARNX("khttp_templatex: %s", kcgi_strerror(rc));
-			break;
+	if (NULL == (curl = mail_init(&m, &t))) {
+		while (0 < (sz = db_player_load_new
+		       (np, MAIL_BATCH, last))) {
+			for (i = 0; i < sz; i++)
+				np[i].state = PSTATE_MAILED;
+			last = np[sz - 1].id;
+			db_player_set_mailed_all(np, sz);
+			db_newplayer_free(np, sz);
 		}
+		return(1);
+	}
 
-		recpts = curl_slist_append(NULL, m.to);
-		curl_easy_setopt(curl, CURLOPT_MAIL_RCPT, recpts);
-		curl_easy_setopt(curl, CURLOPT_READDATA, &m.b);
+	m.uri = uri;
 
-		if (CURLE_OK != (res = curl_easy_perform(curl))) {
-			WARNX("Mail error: %s", curl_easy_strerror(res));
-			db_player_set_state(id, PSTATE_ERROR);
-		} else
-			db_player_set_mailed(id, m.pass);
+	if (NULL == (multi = mailpool_init(curl, slots, MAIL_POOL))) {
+		mail_free(&m, curl, NULL);
+		return(0);
+	}
 
-		mail_clear(&m, &recpts);
+	while ( ! fail && 0 < (sz = db_player_load_new
+	       (np, MAIL_BATCH, last))) {
+		last = np[sz - 1].id;
+		next = active = 0;
+		do {
+			/* Fill idle slots with the next messages. */
+			for (i = 0; ! fail && next < sz && 
+			     i < MAIL_POOL; i++) {
+				if (NULL != slots[i].arg)
+					continue;
+				if ( ! mail_player_start(&m, &t, &tx, 
+				    loginuri, &slots[i], &np[next])) {
+					fail = 1;
+					break;
+				}
+				mailpool_start(multi, 
+					&slots[i], &np[next]);
+				next++;
+				active++;
+			}
+
+			/* Only block if we've nothing to render. */
+			s = mailpool_reap(multi, fail || 
+				next == sz || MAIL_POOL == active, &res);
+			for ( ; NULL != s; 
+			     s = mailpool_reap(multi, 0, &res)) {
+				p = s->arg;
+				if (CURLE_OK != res) {
+					WARNX("Mail error: %s", 
+						curl_easy_strerror(res));
+					p->state = PSTATE_ERROR;
+					errors++;
+				} else
+					p->state = PSTATE_MAILED;
+				s->arg = NULL;
+				active--;
+			}
+		} while (active > 0 || ( ! fail && next < sz));
+
+		db_player_set_mailed_all(np, sz);
+		db_newplayer_free(np, sz);
 	}
 
-	if (NULL != curl)
-		mail_free(&m, curl, recpts);
+	mailpool_free(multi, slots, MAIL_POOL);
+	mail_free(&m, curl, NULL);
+	return( ! fail && 0 == errors);
 }
 
-void 
+static int
 mail_test(void)
 {
 	CURL		  *curl;
@@ -393,12 +607,13 @@ mail_test(void)
 	struct ktemplate   t;
 	struct ktemplatex  tx;
 	enum kcgi_err	   rc;
+	int		   ok = 1;
 
 	memset(&tx, 0, sizeof(struct ktemplatex));
 	tx.writer = mail_write;
 
 	if (NULL == (curl = mail_init(&m, &t)))
-		return;
+		return(1);
 
 	m.to = db_admin_get_mail();
 	rc = khttp_templatex(&t, DATADIR 
@@ -415,11 +630,13 @@ mail_test(void)
 	if (CURLE_OK == (res = curl_easy_perform(curl)))
 		goto out;
 	WARNX("Mail error: %s", curl_easy_strerror(res));
+	ok = 0;
 out:
 	mail_free(&m, curl, recpts);
+	return(ok);
 }
 
-static void 
+static int
 mail_backupfail(const char *fname)
 {
 	CURL		  *curl;
@@ -429,12 +646,13 @@ mail_backupfail(const char *fname)
 	struct ktemplate   t;
 	struct ktemplatex  tx;
 	enum kcgi_err	   rc;
+	int		   ok = 1;
 
 	memset(&tx, 0, sizeof(struct ktemplatex));
 	tx.writer = mail_write;
 
 	if (NULL == (curl = mail_init(&m, &t)))
-		return;
+		return(1);
 
 	m.to = db_admin_get_mail();
 	rc = khttp_templatex(&t, DATADIR 
@@ -451,11 +669,13 @@ mail_backupfail(const char *fname)
 	if (CURLE_OK == (res = curl_easy_perform(curl)))
 		goto out;
 	WARNX("Mail error: %s", curl_easy_strerror(res));
+	ok = 0;
 out:
 	mail_free(&m, curl, recpts);
+	return(ok);
 }
 
-void
+static int
 mail_backup(void)
 {
 	CURL		  *curl;
@@ -465,6 +685,7 @@ mail_backup(void)
 	struct ktemplate   t;
 	struct ktemplatex  tx;
 	enum kcgi_err	   rc;
+	int		   ok = 1;
 	char		   fname[PATH_MAX], date[27];
 	char	   	  *cp;
 	time_t		   tt;
@@ -483,15 +704,14 @@ mail_backup(void)
 	}
 
 	(void)snprintf(fname, sizeof(fname), 
-		"%s/backup-%s.db", DATADIR, date);
+		"%s/backup-%s.db.gz", DATADIR, date);
 
-	if ( ! db_backup(fname)) {
-		mail_backupfail(fname);
-		return;
-	} else if (NULL == (curl = mail_init(&m, &t))) {
+	if ( ! db_backup(fname))
+		return(mail_backupfail(fname));
+	else if (NULL == (curl = mail_init(&m, &t))) {
 		/* coverity[check_return] */
 		(void)chmod(fname, 0);
-		return;
+		return(1);
 	}
 
 	m.fname = fname;
@@ -510,10 +730,12 @@ mail_backup(void)
 	if (CURLE_OK == (res = curl_easy_perform(curl)))
 		goto out;
 	WARNX("Mail error: %s", curl_easy_strerror(res));
+	ok = 0;
 out:
 	if (-1 == chmod(fname, 0))
 		WARN("chmod: %s", fname);
 	mail_free(&m, curl, recpts);
+	return(ok);
 }
 
 void
@@ -521,52 +743,110 @@ mail_wipe(int backup)
 {
 
 	if (backup)
-		mail_backup();
+		(void)mail_backup();
 	db_expr_wipe();
+	metrics_reset();
 }
 
 static void
 mail_appendplayer(const struct player *p, void *arg)
 {
-	struct curl_slist **recpts = arg;
+	struct mailrcpts *r = arg;
 
 	if (p->autoadd)
 		return;
-	*recpts = curl_slist_append(*recpts, p->mail);
+	if (r->sz == r->max) {
+		r->max += 256;
+		r->mails = kreallocarray
+			(r->mails, r->max, sizeof(char *));
+	}
+	r->mails[r->sz++] = kstrdup(p->mail);
 }
 
-void 
-mail_roundadvance(const char *uri, int64_t last, int64_t round)
+/*
+ * Notify all playing players of the round advancing, or only those in
+ * the job's recipients if set by an earlier attempt.
+ * Recipients are split into chunks of at most MAIL_CHUNK, each sent as
+ * its own message over a pool of MAIL_POOL connections.
+ * Chunks that fail are retried up to MAIL_TRIES times.
+ * If any still fail, their recipients are saved to the job for its
+ * next attempt.
+ * Notices for a round that's since been advanced past are dropped.
+ * Returns zero if any recipient could not be mailed.
+ */
+static int
+mail_roundadvance(const struct mailqjob *job)
 {
 	CURL		  *curl;
+	CURLM		  *multi = NULL;
 	CURLcode 	   res;
-	struct curl_slist *recpts = NULL;
+	struct mailslot	   slots[MAIL_POOL], *s;
+	struct mailrcpts   r;
+	struct mailchunk  *chunks = NULL, *c;
 	struct mail	   m;
 	struct ktemplate   t;
 	struct ktemplatex  tx;
 	enum kcgi_err	   rc;
 	struct expr	  *expr;
+	size_t		   i, j, k, chunksz = 0, pending,
+			   retries, failed = 0, failrcpts;
+	int		   sent = 0;
+	char		  *cp, *rcpt, *left;
+	struct mail	   lm;
 
 	memset(&tx, 0, sizeof(struct ktemplatex));
+	memset(&r, 0, sizeof(struct mailrcpts));
 	tx.writer = mail_write;
 
 	if (NULL == (curl = mail_init(&m, &t))) 
-		return;
-	if (NULL == (expr = db_expr_get(1)))
+		return(1);
+	if (NULL == (expr = db_expr_get(1))) {
+		sent = 1;
 		goto out;
+	}
+
+	/* 
+	 * If we've been retried past another advance, the notice for
+	 * that round is already queued: don't announce it twice.
+	 */
+	if (expr->round > job->target) {
+		INFO("Mail: round %" PRId64 " notice: dropped, "
+			"now in round %" PRId64, job->target + 1,
+			expr->round + 1);
+		sent = 1;
+		goto out;
+	}
 
-	m.round = expr->round + 1;
+	m.round = job->target + 1;
 	m.minutes = expr->minutes;
 	m.minminutes = expr->roundmin;
-	m.uri = uri;
-
-	if (-1 == last)
-		db_player_load_all(mail_appendplayer, &recpts);
+	m.uri = job->uri;
+
+	if ('\0' != job->rcpts[0]) {
+		left = cp = kstrdup(job->rcpts);
+		while (NULL != (rcpt = strsep(&cp, "\n"))) {
+			if ('\0' == *rcpt)
+				continue;
+			if (r.sz == r.max) {
+				r.max += 256;
+				r.mails = kreallocarray
+					(r.mails, r.max, sizeof(char *));
+			}
+			r.mails[r.sz++] = kstrdup(rcpt);
+		}
+		free(left);
+	} else if (-1 == job->round)
+		db_player_load_all(mail_appendplayer, &r);
 	else
 		db_player_load_playing(expr, 
-			mail_appendplayer, &recpts);
+			mail_appendplayer, &r);
+
+	if (0 == r.sz) {
+		sent = 1;
+		goto out;
+	}
 
-	rc = khttp_templatex(&t, -1 == last ?
+	rc = khttp_templatex(&t, -1 == job->round ?
 		DATADIR "/mail-roundfirst.eml" : 
 		DATADIR "/mail-roundadvance.eml",
 		&tx, &m);
@@ -575,13 +855,255 @@ mail_roundadvance(const char *uri, int64_t last, int64_t round)
 		goto out;
 	}
 
-	curl_easy_setopt(curl, CURLOPT_MAIL_RCPT, recpts);
-	curl_easy_setopt(curl, CURLOPT_READDATA, &m.b);
+	chunksz = (r.sz + MAIL_CHUNK - 1) / MAIL_CHUNK;
+	chunks = kcalloc(chunksz, sizeof(struct mailchunk));
+	for (i = 0; i < chunksz; i++) {
+		chunks[i].first = i * MAIL_CHUNK;
+		chunks[i].sz = r.sz - chunks[i].first;
+		if (chunks[i].sz > MAIL_CHUNK)
+			chunks[i].sz = MAIL_CHUNK;
+	}
 
-	if (CURLE_OK == (res = curl_easy_perform(curl)))
+	if (NULL == (multi = mailpool_init(curl, slots, MAIL_POOL)))
 		goto out;
-	WARNX("Mail error: %s", curl_easy_strerror(res));
+
+	/* The message is the same for all: give each slot a copy. */
+	for (i = 0; i < MAIL_POOL; i++) {
+		slots[i].b.buf = kmalloc(m.b.sz + 1);
+		memcpy(slots[i].b.buf, m.b.buf, m.b.sz + 1);
+		slots[i].b.sz = slots[i].b.maxsz = m.b.sz;
+	}
+
+	pending = chunksz;
+	retries = failed = failrcpts = 0;
+	do {
+		/*
+		 * Fill idle slots with pending chunks.
+		 * Failed chunks are retried by clearing "busy", so scan
+		 * from the start each time.
+		 */
+		for (i = j = 0; i < MAIL_POOL && j < chunksz; i++) {
+			if (NULL != slots[i].arg)
+				continue;
+			for ( ; j < chunksz; j++)
+				if ( ! chunks[j].busy && ! chunks[j].done)
+					break;
+			if (j == chunksz)
+				break;
+			c = &chunks[j];
+			c->busy = 1;
+			c->tries++;
+			for (k = 0; k < c->sz; k++)
+				slots[i].recpts = curl_slist_append
+					(slots[i].recpts, 
+					 r.mails[c->first + k]);
+			mailpool_start(multi, &slots[i], c);
+		}
+
+		s = mailpool_reap(multi, 1, &res);
+		for ( ; NULL != s; s = mailpool_reap(multi, 0, &res)) {
+			c = s->arg;
+			s->arg = NULL;
+			c->busy = 0;
+			if (CURLE_OK == res) {
+				c->done = 1;
+				pending--;
+				continue;
+			} 
+			WARNX("Mail error: recipients %zu-%zu "
+				"(attempt %zu): %s", c->first, 
+				c->first + c->sz - 1, c->tries,
+				curl_easy_strerror(res));
+			if (c->tries < MAIL_TRIES) {
+				retries++;
+				continue;
+			}
+			c->done = c->failed = 1;
+			pending--;
+			failed++;
+			failrcpts += c->sz;
+		}
+	} while (pending > 0);
+
+	if (0 == failed) {
+		INFO("Mail: round %" PRId64 " notice: %zu recipients, "
+			"%zu messages, %zu retries, %lld seconds "
+			"after advance", m.round, r.sz, chunksz, 
+			retries, (long long)
+			(time(NULL) - expr->roundbegan));
+		sent = 1;
+		goto out;
+	}
+
+	WARNX("Mail: round %" PRId64 " notice: %zu recipients, "
+		"%zu messages, %zu retries, %zu failed "
+		"(%zu recipients), %lld seconds after advance", 
+		m.round, r.sz, chunksz, retries, failed, failrcpts,
+		(long long)(time(NULL) - expr->roundbegan));
+
+	/* Next time, only try those we couldn't reach. */
+	memset(&lm, 0, sizeof(struct mail));
+	for (i = 0; i < chunksz; i++) {
+		if ( ! chunks[i].failed)
+			continue;
+		for (k = 0; k < chunks[i].sz; k++) {
+			rcpt = r.mails[chunks[i].first + k];
+			mail_write(rcpt, strlen(rcpt), &lm);
+			mail_write("\n", 1, &lm);
+		}
+	}
+	db_mailq_rcpts(job->id, lm.b.buf);
+	free(lm.b.buf);
 out:
-	mail_free(&m, curl, recpts);
+	if (NULL != multi)
+		mailpool_free(multi, slots, MAIL_POOL);
+	for (i = 0; i < r.sz; i++)
+		free(r.mails[i]);
+	free(r.mails);
+	free(chunks);
+	mail_free(&m, curl, NULL);
 	db_expr_free(expr);
+	return(sent);
+}
+
+static const char *const mailqs[MAILQ__MAX] = {
+	"players", /* MAILQ_PLAYERS */
+	"round", /* MAILQ_ROUND */
+	"backup", /* MAILQ_BACKUP */
+	"test", /* MAILQ_TEST */
+};
+
+/*
+ * Name of a job's kind for logging: the kind comes from the database,
+ * so may be one we don't know.
+ */
+static const char *
+mailq_name(const struct mailqjob *job)
+{
+
+	if ((size_t)job->kind >= MAILQ__MAX)
+		return("unknown");
+	return(mailqs[job->kind]);
+}
+
+static int
+mail_sendjob(const struct mailqjob *job)
+{
+
+	switch (job->kind) {
+	case (MAILQ_PLAYERS):
+		/* Re-try those who failed last time. */
+		if (job->tries > 0)
+			db_player_reset_error();
+		return(mail_players(job->uri, job->loginuri));
+	case (MAILQ_ROUND):
+		return(mail_roundadvance(job));
+	case (MAILQ_BACKUP):
+		return(mail_backup());
+	case (MAILQ_TEST):
+		/* Don't keep re-sending tests. */
+		(void)mail_test();
+		return(1);
+	default:
+		break;
+	}
+
+	WARNX("Mail queue: job %" PRId64 ": unknown "
+		"kind %d (dropping)", job->id, job->kind);
+	return(1);
+}
+
+/*
+ * Send everything in the mail queue (see db_mailq_add()), waiting on
+ * jobs deferred for retry, until it's empty.
+ * Only one sender runs at a time, serialised by an exclusive lock on
+ * MAILQ_LOCK: if another is running, this returns immediately and the
+ * running sender picks up our jobs.
+ * Failed jobs are retried after MAILQ_BACKOFF seconds, doubling with
+ * each failure, and dropped after MAILQ_TRIES attempts.
+ * This should be run in its own (daemonised) process.
+ */
+void
+mail_sendq(void)
+{
+	struct mailqjob	*job;
+	struct timespec	 t0, t1;
+	time_t		 now, start;
+	double		 elapsed;
+	size_t		 sent = 0, retried = 0, dropped = 0;
+	int		 fd;
+
+	if (-1 == (fd = open(MAILQ_LOCK, O_RDWR | O_CREAT, 0600))) {
+		WARN("open: %s", MAILQ_LOCK);
+		return;
+	}
+	start = time(NULL);
+again:
+	if (-1 == flock(fd, LOCK_EX | LOCK_NB)) {
+		if (EWOULDBLOCK != errno)
+			WARN("flock: %s", MAILQ_LOCK);
+		close(fd);
+		return;
+	}
+
+	INFO("Mail queue: sender starting: %u", getpid());
+
+	while (NULL != (job = db_mailq_next())) {
+		now = time(NULL);
+		if (job->next > now) {
+			/* Wake up regularly to see new jobs. */
+			sleep(job->next - now > MAILQ_POLL ?
+				MAILQ_POLL : job->next - now);
+			db_mailq_free(job);
+			continue;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		if (mail_sendjob(job)) {
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			elapsed = (t1.tv_sec - t0.tv_sec) +
+				(t1.tv_nsec - t0.tv_nsec) / 1.0e9;
+			INFO("Mail queue: job %" PRId64 " (%s) "
+				"sent in %.3f seconds, %lld seconds "
+				"after queueing", job->id, 
+				mailq_name(job), elapsed, 
+				(long long)(time(NULL) - job->ctime));
+			db_mailq_delete(job->id);
+			sent++;
+		} else if (job->tries + 1 >= MAILQ_TRIES) {
+			WARNX("Mail queue: job %" PRId64 " (%s) "
+				"failed %" PRId64 " times (dropping)", 
+				job->id, mailq_name(job), 
+				job->tries + 1);
+			db_mailq_delete(job->id);
+			dropped++;
+		} else {
+			WARNX("Mail queue: job %" PRId64 " (%s) "
+				"failed (retrying in %lld seconds)", 
+				job->id, mailq_name(job),
+				(long long)MAILQ_BACKOFF << job->tries);
+			db_mailq_retry(job->id, time(NULL) + 
+				((time_t)MAILQ_BACKOFF << job->tries));
+			retried++;
+		}
+		db_mailq_free(job);
+	}
+
+	/*
+	 * A job may have been queued after we last looked but before
+	 * we unlocked, its own sender having given up on our lock.
+	 * So look again after unlocking.
+	 */
+	flock(fd, LOCK_UN);
+	if (NULL != (job = db_mailq_next())) {
+		db_mailq_free(job);
+		goto again;
+	}
+	close(fd);
+
+	now = time(NULL) - start;
+	INFO("Mail queue: sender exiting: %zu sent, %zu retried, "
+		"%zu dropped in %lld seconds (%.2f jobs/minute): %u", 
+		sent, retried, dropped, (long long)now, 
+		now > 0 ? sent * 60.0 / now : (double)sent, getpid());
 }
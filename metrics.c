@@ -0,0 +1,210 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2015, 2016 Kristaps Dzonsons <kristaps@kcons.eu>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <kcgi.h>
+#include <kcgijson.h>
+#include <gmp.h>
+
+#include "extern.h"
+
+/*
+ * Bump when struct metrics changes: older maps are then reset.
+ */
+#define	METRICS_VERSION 1
+
+/*
+ * Each of our processes is short-lived, so metrics are kept in a file
+ * mapped into all of them and updated with atomic operations.
+ * Nothing is locked when counting, so a per-second slot being recycled
+ * may lose a concurrent count: this is fine for monitoring.
+ * If the file can't be mapped, metrics are silently not kept.
+ */
+static	struct metrics *metrics;
+static	int metrics_tried;
+
+static struct metrics *
+metrics_get(void)
+{
+	struct stat	 st;
+	void		*map;
+	int		 fd;
+
+	if (metrics_tried)
+		return(metrics);
+	metrics_tried = 1;
+
+	fd = open(DATADIR "/metrics.map", O_RDWR | O_CREAT, 0600);
+	if (-1 == fd) {
+		WARN(DATADIR "/metrics.map");
+		return(NULL);
+	} else if (-1 == flock(fd, LOCK_EX)) {
+		WARN(DATADIR "/metrics.map");
+		close(fd);
+		return(NULL);
+	} else if (-1 == fstat(fd, &st)) {
+		WARN(DATADIR "/metrics.map");
+		close(fd);
+		return(NULL);
+	}
+
+	if (st.st_size != sizeof(struct metrics) &&
+	    -1 == ftruncate(fd, sizeof(struct metrics))) {
+		WARN(DATADIR "/metrics.map");
+		close(fd);
+		return(NULL);
+	}
+
+	map = mmap(NULL, sizeof(struct metrics),
+		PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (MAP_FAILED == map) {
+		WARN("mmap");
+		close(fd);
+		return(NULL);
+	}
+
+	metrics = map;
+	if (st.st_size != sizeof(struct metrics) ||
+	    METRICS_VERSION != metrics->version) {
+		memset(metrics, 0, sizeof(struct metrics));
+		metrics->version = METRICS_VERSION;
+		metrics->since = time(NULL);
+	}
+
+	/* The mapping outlives the descriptor and its lock. */
+	close(fd);
+	return(metrics);
+}
+
+/*
+ * Add "n" to counter "m", both in total and in this second's slot.
+ */
+void
+metrics_add(enum metric m, uint64_t n)
+{
+	struct metrics	*p;
+	struct metricslot *s;
+	int64_t		 now, sec;
+	size_t		 i;
+
+	if (0 == n || NULL == (p = metrics_get()))
+		return;
+
+	__atomic_fetch_add(&p->totals[m], n, __ATOMIC_RELAXED);
+
+	now = time(NULL);
+	s = &p->slots[now % METRICS_SECS];
+	sec = __atomic_load_n(&s->sec, __ATOMIC_RELAXED);
+	if (sec != now && __atomic_compare_exchange_n(&s->sec,
+	    &sec, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		for (i = 0; i < METRIC__MAX; i++)
+			__atomic_store_n(&s->counts[i],
+				0, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&s->counts[m], n, __ATOMIC_RELAXED);
+}
+
+/*
+ * Record a duration "secs" in histogram "h".
+ * Bucket i counts durations of [2^i, 2^(i+1)) microseconds, the first
+ * also counting shorter ones and the last longer ones.
+ */
+void
+metrics_time(enum mhist h, double secs)
+{
+	struct metrics	*p;
+	struct metrichist *hp;
+	uint64_t	 us, max;
+	size_t		 i;
+
+	if (NULL == (p = metrics_get()))
+		return;
+
+	hp = &p->hists[h];
+	us = secs > 0.0 ? (uint64_t)(secs * 1.0e6) : 0;
+	for (i = 0; i < METRICS_BUCKETS - 1 && us >> (i + 1); i++)
+		continue;
+
+	__atomic_fetch_add(&hp->buckets[i], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hp->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hp->sum, us, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&hp->max, __ATOMIC_RELAXED);
+	while (us > max && ! __atomic_compare_exchange_n(&hp->max,
+	       &max, us, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		continue;
+}
+
+/*
+ * Copy the current metrics into "p".
+ * Returns zero if there are none (they couldn't be mapped).
+ */
+int
+metrics_read(struct metrics *p)
+{
+	const struct metrics *m;
+
+	if (NULL == (m = metrics_get()))
+		return(0);
+	memcpy(p, m, sizeof(struct metrics));
+	return(1);
+}
+
+/*
+ * Sum counter "m" over the last "secs" seconds (at most METRICS_SECS),
+ * not counting the current second.
+ */
+uint64_t
+metrics_window(const struct metrics *p, enum metric m, int64_t secs)
+{
+	int64_t		 now;
+	uint64_t	 sum = 0;
+	size_t		 i;
+
+	if (secs > METRICS_SECS - 1)
+		secs = METRICS_SECS - 1;
+	now = time(NULL);
+	for (i = 0; i < METRICS_SECS; i++)
+		if (p->slots[i].sec < now &&
+		    p->slots[i].sec >= now - secs)
+			sum += p->slots[i].counts[m];
+	return(sum);
+}
+
+/*
+ * Start counting afresh, e.g., for a new experiment.
+ */
+void
+metrics_reset(void)
+{
+	struct metrics	*p;
+
+	if (NULL == (p = metrics_get()))
+		return;
+	memset(p, 0, sizeof(struct metrics));
+	p->version = METRICS_VERSION;
+	p->since = time(NULL);
+}
@@ -105,6 +105,7 @@ mpq_str2mpqinit(const unsigned char *v, mpq_t val)
 {
 	int	 rc;
 
+	reqstats.mpqs++;
 	mpq_init(val);
 	rc = mpq_set_str(val, (const char *)v, 10);
 	assert(0 == rc);
@@ -120,6 +121,7 @@ mpq_str2mpqsinit(const unsigned char *v, size_t sz)
 	int	 rc;
 
 	p = kcalloc(sz, sizeof(mpq_t));
+	reqstats.mpqs += sz;
 
 	if (1 == sz) {
 		mpq_init(p[0]);
@@ -155,6 +157,8 @@ mpq_str2mpq(const char *v, mpq_t q)
 	size_t		 i, sz, precision;
 	mpq_t		 tmp, stor;
 
+	reqstats.mpqs++;
+
 	/* First pass: MPQ all non-dotted numbers. */
 	if (NULL == (cp = strchr(v, '.'))) {
 		mpq_init(q);
@@ -310,6 +314,7 @@ mpq_summation_str(mpq_t op, const unsigned char *v)
 	int	 rc;
 	mpq_t	 tmp;
 
+	reqstats.mpqs++;
 	mpq_init(tmp);
 	rc = mpq_set_str(tmp, (const char *)v, 10);
 	assert(0 == rc);
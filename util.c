@@ -38,6 +38,8 @@
  * happened, 0 if it's in the child "long-running" process, and 1 if
  * it's in the caller process.
  * The "middle" process never returns.
+ * If "r" is NULL, we're not in an HTTP request (e.g., already in a
+ * long-running process).
  */
 int
 doublefork(struct kreq *r)
@@ -55,7 +57,8 @@ doublefork(struct kreq *r)
 		}
 		return(1);
 	}
-	khttp_child_free(r);
+	if (NULL != r)
+		khttp_child_free(r);
 	if (-1 == daemon(1, 1)) {
 		WARN("daemon");
 		exit(EXIT_SUCCESS);